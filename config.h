@@ -106,9 +106,10 @@
 #define ALIGNMENT 8
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, unless MM_MAX_HEAP (or mdriver -m) says
+ * otherwise. Only address space is reserved up front.
  */
-#define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#define MAX_HEAP ((size_t)64<<30)  /* 64 GB, reserved not committed */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
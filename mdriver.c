@@ -10,6 +10,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
@@ -18,6 +19,10 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 
 #include "mm.h"
@@ -25,6 +30,7 @@
 #include "fsecs.h"
 #include "config.h"
 #include "driverlib.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -38,6 +44,10 @@
 /* Returns true if p is ALIGNMENT-byte aligned */
 #define IS_ALIGNED(p)  ((((unsigned long)(p)) % ALIGNMENT) == 0)
 
+/* Microbenchmarks (-b) */
+#define BENCH_LIVE  1024     /* objects kept live while churning */
+#define BENCH_OPS   (1<<16)  /* free/alloc pairs per run */
+
 /* weights */
 #define WNONE 0
 #define WALL 1
@@ -63,12 +73,20 @@ typedef struct range_t {
 	int index;             /* same index as free; for debugging */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/*
+ * A request packed into 8 bytes for the timed replay: the type in the
+ * low 2 bits of op, log2 of a memalign alignment in the next 5 and the
+ * block id above them. free(NULL) uses id num_ids, whose block stays NULL.
+ */
 typedef struct {
-	enum { ALLOC, FREE, REALLOC } type; /* type of request */
-	int index;                        /* index for free() to use later */
-	size_t size;                      /* byte size of alloc/realloc request */
-} traceop_t;
+	uint32_t op;
+	uint32_t size;
+} packop_t;
+#define PACK_TYPE(o)  ((o).op & 3)
+#define PACK_SHIFT(o) ((o).op >> 2 & 31)
+#define PACK_INDEX(o) ((o).op >> 7)
+#define PACK_IDS      (1 << 25)  /* traces with more ids aren't packed */
+#define PACK_AHEAD    8          /* requests to prefetch the block of ahead */
 
 /* Holds the information for one trace file*/
 typedef struct {
@@ -78,6 +96,8 @@ typedef struct {
 	int num_ops;         /* number of distinct requests */
 	int weight;          /* weight for this trace (unused) */
 	traceop_t *ops;      /* array of requests */
+	size_t map_len;      /* bytes mapped if ops is in a binary trace, or 0 */
+	packop_t *packed;    /* ops packed for eval_mm_speed, or NULL */
 	char **blocks;       /* array of ptrs returned by malloc/realloc... */
 	size_t *block_sizes; /* ... and a corresponding array of payload sizes */
 	int *block_rand_base;/* index into random_data, if debug is on */
@@ -93,6 +113,12 @@ typedef struct {
 	range_t *ranges;
 } speed_t;
 
+/* A microbenchmark selectable with -b */
+typedef struct {
+	const char *name;
+	void (*run)(void);
+} bench_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
 	/* set in read_trace */
@@ -106,6 +132,9 @@ typedef struct {
 
 	/* defined only for the student malloc package */
 	double util;     /* space utilization for this trace (always 0 for libc) */
+	mem_stats_t mem; /* what memlib saw during the util run */
+	double harness;  /* secs of that the replay itself takes, with -C */
+	double startup;  /* secs of that mm_init takes */
 
 	/* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -135,6 +164,19 @@ int verbose = 1;        /* global flag for verbose output */
 static int errors = 0;  /* number of errs found when running student malloc */
 int onetime_flag = 0;
 
+/* measure utilization through mm_halloc handles, compacting as we go */
+static int handle_mode = 0;
+#define HANDLE_BUDGET 4096 /* bytes mm_hcompact may move per free */
+
+/* time on a pre-faulted heap without sbrk(), not the realistic model */
+static int prefault_mode = 0;
+
+/* leave the startup time out of secs, and so out of Kops */
+static int startup_excluded = 0;
+
+/* time the harness on a null allocator and report net times too */
+static int calibrate_mode = 0;
+
 /* by default, no timeouts */
 static int set_timeout = 0;
 
@@ -155,7 +197,7 @@ char autoresult[SUBMITR_MAXBUF]; /* autoresult string */
  *********************/
 
 /* these functions manipulate range lists */
-static int add_range(range_t **ranges, char *lo, int size,
+static int add_range(range_t **ranges, char *lo, size_t size,
 		const trace_t *trace, int opnum, int index);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
@@ -168,6 +210,9 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename);
+static int map_trace(trace_t *trace, FILE *tracefile);
+static void alloc_trace_blocks(trace_t *trace);
+static void pack_trace(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -179,10 +224,33 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
+static double eval_mm_util_handles(trace_t *trace, int tracenum);
 static void eval_mm_speed(void *ptr);
+static void eval_null_speed(void *ptr);
+static double eval_mm_startup(void);
+static void eval_mm_stream(const char *filename);
+
+/* Microbenchmarks that compare mm entry points against each other */
+static void run_bench(const char *name);
+static void bench_cache(void);
+static void bench_sized(void);
+static void bench_usable(void);
+static void bench_batch(void);
+static void bench_calloc(void);
+static void bench_zpool(void);
+static void bench_copy(void);
+static void bench_mremap(void);
+static void bench_mesh(void);
+static void bench_persist(void);
+static void bench_shared(void);
+static void bench_regions(void);
+static void bench_heaps(void);
+static double bench_nsecs(void);
 
 /* Various helper routines */
-static void printresults(int n, stats_t *stats);
+static int in_region(const char *lo, const char *hi);
+static void printresults(int n, stats_t *stats, int memlib);
+static void printnet(int n, stats_t *stats);
 static void usage(void);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
 	__attribute__((format(printf, 3,4)));
@@ -235,12 +303,28 @@ static void run_tests(int num_tracefiles, const char *tracedir,
 		if (mm_stats[i].valid) {
 			if (verbose > 1)
 				printf("efficiency, ");
-			mm_stats[i].util = eval_mm_util(trace, i);
+			/* a fresh heap, so memlib counts every first touch */
+			mem_deinit();
+			mem_init();
+			mm_stats[i].util = handle_mode ?
+				eval_mm_util_handles(trace, i) : eval_mm_util(trace, i);
+			mem_stats(&mm_stats[i].mem);
 			speed_params->trace = trace;
 			speed_params->ranges = ranges;
 			if (verbose > 1)
 				printf("and performance.\n");
+			if (prefault_mode) {
+				/* fault in as much as the util run used up front */
+				mem_set_options(MEM_PREFAULT | MEM_NO_SBRK);
+				mem_prefault(mem_peaksize());
+			}
 			mm_stats[i].secs = fsecs(eval_mm_speed, speed_params);
+			mm_stats[i].startup = eval_mm_startup();
+			mem_set_options(0);
+			if (startup_excluded && mm_stats[i].secs > mm_stats[i].startup)
+				mm_stats[i].secs -= mm_stats[i].startup;
+			if (calibrate_mode)
+				mm_stats[i].harness = fsecs(eval_null_speed, speed_params);
 		}
 
 		free_trace(trace);
@@ -266,6 +350,8 @@ int main(int argc, char **argv)
 	speed_t speed_params;      /* input parameters to the xx_speed routines */
 
 	int run_libc = 0;     /* If set, run libc malloc (set by -l) */
+	char *bench = NULL;   /* If set, run this microbenchmark instead (-b) */
+	char *stream = NULL;  /* If set, stream this trace through mm (-S) */
 	int autograder = 0;   /* if set then called by autograder (-A) */
 
 	/* temporaries used to compute the performance index */
@@ -280,7 +366,7 @@ int main(int argc, char **argv)
 	/*
 	 * Read and interpret the command line arguments
 	 */
-	while ((c = getopt(argc, argv, "d:f:c:s:t:v:hVAlD")) != EOF) {
+	while ((c = getopt(argc, argv, "b:d:f:c:m:s:t:v:hVAlCDHIPS:")) != EOF) {
 		switch (c) {
 
 			case 'A': /* Hidden Autolab driver argument */
@@ -314,6 +400,14 @@ int main(int argc, char **argv)
 					strcat(tracedir, "/"); /* path always ends with "/" */
 				break;
 
+			case 'b': /* Run a microbenchmark instead of the traces */
+				bench = optarg;
+				break;
+
+			case 'S': /* Stream one trace instead of loading the traces */
+				stream = optarg;
+				break;
+
 			case 'l': /* Run libc malloc */
 				run_libc = 1;
 				break;
@@ -334,6 +428,27 @@ int main(int argc, char **argv)
 				debug_mode = DBG_EXPENSIVE;
 				break;
 
+			case 'I': /* Leave startup out of the Kops */
+				startup_excluded = 1;
+				break;
+
+			case 'C': /* Time the harness alone too */
+				calibrate_mode = 1;
+				break;
+
+			case 'H': /* Measure utilization through handles */
+				handle_mode = 1;
+				break;
+
+			case 'm': /* Heap size limit, memlib reads it in mem_init */
+				if (setenv("MM_MAX_HEAP", optarg, 1) < 0)
+					unix_error("setenv failed");
+				break;
+
+			case 'P': /* Time without page faults or sbrk() */
+				prefault_mode = 1;
+				break;
+
 			case 's':
 				set_timeout = atoi(optarg);
 				break;
@@ -348,6 +463,21 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/* Microbenchmarks replace the trace runs */
+	if (bench != NULL) {
+		init_fsecs();
+		run_bench(bench);
+		exit(0);
+	}
+
+	/* So does streaming a trace */
+	if (stream != NULL) {
+		mem_init();
+		eval_mm_stream(stream);
+		mem_deinit();
+		exit(0);
+	}
+
 	if (tracefiles == NULL) {
 		tracefiles = default_tracefiles;
 		num_tracefiles = sizeof(default_tracefiles) / sizeof(char *) - 1;
@@ -398,7 +528,7 @@ int main(int argc, char **argv)
 		/* Display the libc results in a compact table */
 		if (verbose) {
 			printf("\nResults for libc malloc:\n");
-			printresults(num_tracefiles, libc_stats);
+			printresults(num_tracefiles, libc_stats, 0);
 		}
 	}
 
@@ -428,7 +558,11 @@ int main(int argc, char **argv)
 			}
 		} else {
 			printf("\nResults for mm malloc:\n");
-			printresults(num_tracefiles, mm_stats);
+			printresults(num_tracefiles, mm_stats, 1);
+			if (calibrate_mode) {
+				printf("\nNet of the harness:\n");
+				printnet(num_tracefiles, mm_stats);
+			}
 			printf("\n");
 		}
 	}
@@ -560,7 +694,7 @@ int main(int argc, char **argv)
  *     size bytes at addr lo. After checking the block for correctness,
  *     we create a range struct for this block and add it to the range list.
  */
-static int add_range(range_t **ranges, char *lo, int size,
+static int add_range(range_t **ranges, char *lo, size_t size,
 		const trace_t *trace, int opnum, int index)
 {
 	char *hi = lo + size - 1;
@@ -575,15 +709,24 @@ static int add_range(range_t **ranges, char *lo, int size,
 		return 0;
 	}
 
-	/* The payload must lie within the extent of the heap */
-	if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-			(hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) {
+	/* The payload must lie within the extent of the heap, or within
+	   one mapping or region memlib handed out */
+	if (!in_region(lo, hi)) {
 		malloc_error(trace, opnum,
 				"Payload (%p:%p) lies outside heap (%p:%p)",
 				lo, hi, mem_heap_lo(), mem_heap_hi());
 		return 0;
 	}
 
+	/* The allocator must own up to at least the requested size; only
+	   asked once the block is known to be in the heap */
+	if (mm_malloc_usable_size(lo) < size) {
+		malloc_error(trace, opnum,
+				"Usable size of payload %p is %zu, less than %zu requested",
+				lo, mm_malloc_usable_size(lo), size);
+		return 0;
+	}
+
 	/* If we can't afford the linear-time loop, we check less thoroughly and
 	   just assume the overlap will be caught by writing random bits. */
 	if(trace->ignore_ranges || debug_mode == DBG_NONE) return 1;
@@ -715,7 +858,8 @@ static void check_index(const trace_t *trace, int opnum, int index) {
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory. A binary trace
+ *     (see trace.h) is mapped as it is instead of parsed.
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
 		const char *filename)
@@ -723,7 +867,8 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	FILE *tracefile;
 	trace_t *trace;
 	char type[MAXLINE];
-	int index, size;
+	int index, align;
+	size_t size;
 	int max_index = 0;
 	int op_index;
 
@@ -740,6 +885,16 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	if ((tracefile = fopen(trace->filename, "r")) == NULL) {
 		unix_error("Could not open %s in read_trace", trace->filename);
 	}
+	if (map_trace(trace, tracefile) == 0) {
+		fclose(tracefile);
+		alloc_trace_blocks(trace);
+		pack_trace(trace);
+		strcpy(stats->filename, trace->filename);
+		stats->weight = trace->weight;
+		stats->ops = trace->num_ops;
+		return trace;
+	}
+	trace->map_len = 0;
 	fscanf(tracefile, "%d", &trace->weight);
 	fscanf(tracefile, "%d", &trace->num_ids);
 	fscanf(tracefile, "%d", &trace->num_ops);
@@ -757,21 +912,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 				(traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
 		unix_error("malloc 2 failed in read_trace");
 
-	/* We'll keep an array of pointers to the allocated blocks here... */
-	if ((trace->blocks =
-				(char **)calloc(trace->num_ids, sizeof(char *))) == NULL)
-		unix_error("malloc 3 failed in read_trace");
-
-	/* ... along with the corresponding byte sizes of each block */
-	if ((trace->block_sizes =
-				(size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
-		unix_error("malloc 4 failed in read_trace");
-
-	/* and, if we're debugging, the offset into the random data */
-	if ((trace->block_rand_base =
-				calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
-		unix_error("malloc 5 failed in read_trace");
-
+	alloc_trace_blocks(trace);
 
 	/* read every request line in the trace file */
 	index = 0;
@@ -779,21 +920,32 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	while (fscanf(tracefile, "%s", type) != EOF) {
 		switch(type[0]) {
 			case 'a':
-				fscanf(tracefile, "%u %u", &index, &size);
+				fscanf(tracefile, "%d %zu", &index, &size);
 				trace->ops[op_index].type = ALLOC;
 				trace->ops[op_index].index = index;
 				trace->ops[op_index].size = size;
 				max_index = (index > max_index) ? index : max_index;
 				break;
 			case 'r':
-				fscanf(tracefile, "%u %u", &index, &size);
+				fscanf(tracefile, "%d %zu", &index, &size);
 				trace->ops[op_index].type = REALLOC;
 				trace->ops[op_index].index = index;
 				trace->ops[op_index].size = size;
 				max_index = (index > max_index) ? index : max_index;
 				break;
+			case 'm':
+				fscanf(tracefile, "%d %zu %d", &index, &size, &align);
+				if (align <= 0 || (align & (align - 1)) != 0)
+					app_error("%s: memalign alignment %d is not a power of 2",
+							trace->filename, align);
+				trace->ops[op_index].type = MEMALIGN;
+				trace->ops[op_index].index = index;
+				trace->ops[op_index].align = align;
+				trace->ops[op_index].size = size;
+				max_index = (index > max_index) ? index : max_index;
+				break;
 			case 'f':
-				fscanf(tracefile, "%ud", &index);
+				fscanf(tracefile, "%d", &index);
 				trace->ops[op_index].type = FREE;
 				trace->ops[op_index].index = index;
 				break;
@@ -807,6 +959,7 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	fclose(tracefile);
 	assert(max_index == trace->num_ids - 1);
 	assert(trace->num_ops == op_index);
+	pack_trace(trace);
 
 	/* fill in the stats */
 	strcpy(stats->filename, trace->filename);
@@ -816,6 +969,114 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
 	return trace;
 }
 
+/*
+ * map_trace - if tracefile is a binary trace, map it and point
+ *     trace->ops at its records. Returns 0, or -1 for a text trace.
+ */
+static int map_trace(trace_t *trace, FILE *tracefile)
+{
+	int fd = fileno(tracefile);
+	tracehdr_t hdr;
+	struct stat st;
+	char *map;
+
+	/* all of the magic but its last digit, the format's version */
+	if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+			memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic) - 1) != 0)
+		return -1;
+	if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+			hdr.op_size != sizeof(traceop_t))
+		app_error("%s: written by another version or machine, convert it again",
+				trace->filename);
+	if (hdr.num_ids < 0 || hdr.num_ids > INT_MAX ||
+			hdr.num_ops < 0 || hdr.num_ops > INT_MAX)
+		app_error("%s: too big to load, stream it with -S", trace->filename);
+	if (fstat(fd, &st) < 0 || (size_t)st.st_size !=
+			sizeof(hdr) + (size_t)hdr.num_ops * sizeof(traceop_t))
+		app_error("%s: binary trace has the wrong length", trace->filename);
+	if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) ==
+			MAP_FAILED)
+		unix_error("mmap failed in read_trace");
+	trace->weight = hdr.weight;
+	trace->num_ids = hdr.num_ids;
+	trace->num_ops = hdr.num_ops;
+	trace->ignore_ranges = hdr.ignore_ranges;
+	trace->ops = (traceop_t *)(map + sizeof(hdr));
+	trace->map_len = st.st_size;
+	return 0;
+}
+
+/*
+ * alloc_trace_blocks - allocate the per block arrays of trace
+ */
+static void alloc_trace_blocks(trace_t *trace)
+{
+	/* We'll keep an array of pointers to the allocated blocks here,
+	   with one more that stays NULL for the packed free(NULL)... */
+	if ((trace->blocks =
+				(char **)calloc(trace->num_ids + 1, sizeof(char *))) == NULL)
+		unix_error("malloc 3 failed in read_trace");
+
+	/* ... along with the corresponding byte sizes of each block */
+	if ((trace->block_sizes =
+				(size_t *)calloc(trace->num_ids,  sizeof(size_t))) == NULL)
+		unix_error("malloc 4 failed in read_trace");
+
+	/* and, if we're debugging, the offset into the random data */
+	if ((trace->block_rand_base =
+				calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+		unix_error("malloc 5 failed in read_trace");
+}
+
+/*
+ * pack_trace - check every request of trace, then pack them into
+ *     trace->packed, unless an id or a size doesn't fit. The PACK_AHEAD
+ *     requests past the end are zero so the replay can prefetch without
+ *     a bounds check.
+ */
+static void pack_trace(trace_t *trace)
+{
+	traceop_t *op;
+	packop_t *pk;
+	int i, index, fits = trace->num_ids < PACK_IDS;
+
+	/* a mapped trace is used as it is, so nothing else checks these */
+	for (i = 0; i < trace->num_ops; i++) {
+		op = &trace->ops[i];
+		if (op->type != ALLOC && op->type != FREE &&
+				op->type != REALLOC && op->type != MEMALIGN)
+			app_error("%s: request %d has a bogus type %d",
+					trace->filename, i, (int)op->type);
+		if (op->index < (op->type == FREE ? -1 : 0) ||
+				op->index >= trace->num_ids)	/* free(NULL) is -1 */
+			app_error("%s: request %d has block id %ld out of range",
+					trace->filename, i, op->index);
+		if (op->type == MEMALIGN &&
+				(op->align <= 0 || (op->align & (op->align - 1)) != 0))
+			app_error("%s: memalign alignment %d is not a power of 2",
+					trace->filename, op->align);
+		if (op->type != FREE && op->size > UINT32_MAX)
+			fits = 0;
+	}
+
+	trace->packed = NULL;
+	if (!fits)
+		return;
+	if ((trace->packed = calloc(trace->num_ops + PACK_AHEAD,
+					sizeof(packop_t))) == NULL)
+		unix_error("malloc failed in pack_trace");
+	for (i = 0; i < trace->num_ops; i++) {
+		op = &trace->ops[i];
+		pk = &trace->packed[i];
+		index = op->index < 0 ? trace->num_ids : op->index;
+		pk->op = (uint32_t)index << 7 | op->type;
+		if (op->type == MEMALIGN)
+			pk->op |= __builtin_ctz(op->align) << 2;
+		if (op->type != FREE)
+			pk->size = op->size;
+	}
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -828,11 +1089,16 @@ static void reinit_trace(trace_t *trace)
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated (or for ops, maybe
+ *              mapped) in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-	free(trace->ops);         /* free the three arrays... */
+	if (trace->map_len != 0)  /* unmap or free the four arrays... */
+		munmap((char *)trace->ops - sizeof(tracehdr_t), trace->map_len);
+	else
+		free(trace->ops);
+	free(trace->packed);
 	free(trace->blocks);
 	free(trace->block_sizes);
 	free(trace->block_rand_base);
@@ -912,6 +1178,33 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
 				randomize_block(trace, index);
 				break;
 
+			case MEMALIGN: /* mm_memalign */
+
+				/* Call the student's memalign */
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+					malloc_error(trace, i, "mm_memalign failed.");
+					return 0;
+				}
+
+				/* On top of the checks in add_range, the payload has to
+				 * honour the requested alignment */
+				if (((unsigned long)p % trace->ops[i].align) != 0) {
+					malloc_error(trace, i,
+							"Payload address (%p) not aligned to %d bytes",
+							p, trace->ops[i].align);
+					return 0;
+				}
+				if (add_range(ranges, p, size, trace, i, index) == 0)
+					return 0;
+
+				/* Remember region */
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+
+				/* Set to random data, for debugging. */
+				randomize_block(trace, index);
+				break;
+
 			case REALLOC: /* mm_realloc */
 				check_index(trace, i, index);
 
@@ -981,9 +1274,10 @@ static int eval_mm_valid(trace_t *trace, range_t **ranges)
  *   an optimal allocator, i.e., no gaps and no internal fragmentation.
  *   Utilization is the ratio hwm/heapsize, where heapsize is the
  *   size of the heap in bytes after running the student's malloc
- *   package on the trace. Note that our implementation of mem_sbrk()
- *   doesn't allow the students to decrement the brk pointer, so brk
- *   is always the high water mark of the heap.
+ *   package on the trace, plus whatever it had mapped with mem_map at
+ *   the time the two together peaked. mem_sbrk() can give memory back
+ *   with a negative increment, so brk is not the high water mark:
+ *   memlib keeps the peak itself (mem_peaksize).
  *
  *   A higher number is better: 1 is optimal.
  */
@@ -991,9 +1285,9 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 {
 	int i;
 	int index;
-	int size, newsize, oldsize;
-	int max_total_size = 0;
-	int total_size = 0;
+	size_t size, newsize, oldsize;
+	size_t max_total_size = 0;
+	size_t total_size = 0;
 	char *p;
 	char *newp, *oldp;
 
@@ -1023,6 +1317,22 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 				total_size += size;
 				break;
 
+			case MEMALIGN: /* mm_memalign */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+
+				if ((p = mm_memalign(trace->ops[i].align, size)) == NULL) {
+					app_error("trace %d: mm_memalign failed in eval_mm_util",
+							tracenum);
+				}
+
+				/* Remember region and size */
+				trace->blocks[index] = p;
+				trace->block_sizes[index] = size;
+
+				total_size += size;
+				break;
+
 			case REALLOC: /* mm_realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
@@ -1068,25 +1378,110 @@ static double eval_mm_util(trace_t *trace, int tracenum)
 
 	printf(".");
 
-	return ((double)max_total_size / (double)mem_heapsize());
+	return ((double)max_total_size / (double)mem_peaksize());
 }
 
 
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * eval_mm_util_handles - eval_mm_util with every block behind a handle
+ *   from mm_halloc, and mm_hcompact given HANDLE_BUDGET bytes to move
+ *   after every free. Alignment requests are ignored, as handle blocks
+ *   can't be aligned.
  */
-static void eval_mm_speed(void *ptr)
+static double eval_mm_util_handles(trace_t *trace, int tracenum)
 {
-	int i, index, size, newsize;
-	char *p, *newp, *oldp, *block;
-	trace_t *trace = ((speed_t *)ptr)->trace;
+	int i;
+	int index;
+	size_t size, newsize, oldsize;
+	size_t max_total_size = 0;
+	size_t total_size = 0;
+	mm_handle_t *handles;
+
+	if ((handles = calloc(trace->num_ids, sizeof(mm_handle_t))) == NULL)
+		unix_error("calloc failed in eval_mm_util_handles");
+
 	reinit_trace(trace);
 
-	/* Reset the heap and initialize the mm package */
+	/* initialize the heap and the mm malloc package */
 	mem_reset_brk();
 	if (mm_init() < 0)
-		app_error("mm_init failed in eval_mm_speed");
+		app_error("trace %d: mm_init failed in eval_mm_util_handles",
+				tracenum);
+
+	for (i = 0;  i < trace->num_ops;  i++) {
+		switch (trace->ops[i].type) {
+
+			case ALLOC: /* mm_halloc */
+			case MEMALIGN:
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+
+				if ((handles[index] = mm_halloc(size)) == 0) {
+					app_error("trace %d: mm_halloc failed in eval_mm_util_handles",
+							tracenum);
+				}
+				trace->block_sizes[index] = size;
+				total_size += size;
+				break;
+
+			case REALLOC: /* mm_hrealloc */
+				index = trace->ops[i].index;
+				newsize = trace->ops[i].size;
+				oldsize = trace->block_sizes[index];
+
+				if (newsize == 0) {
+					mm_hfree(handles[index]);
+					handles[index] = 0;
+				} else if (handles[index] == 0) {
+					if ((handles[index] = mm_halloc(newsize)) == 0)
+						app_error("trace %d: mm_halloc failed in eval_mm_util_handles",
+								tracenum);
+				} else if (mm_hrealloc(handles[index], newsize) < 0) {
+					app_error("trace %d: mm_hrealloc failed in eval_mm_util_handles",
+							tracenum);
+				}
+				trace->block_sizes[index] = newsize;
+				total_size += (newsize - oldsize);
+				break;
+
+			case FREE: /* mm_hfree */
+				index = trace->ops[i].index;
+				if (index >= 0) {
+					mm_hfree(handles[index]);
+					handles[index] = 0;
+					total_size -= trace->block_sizes[index];
+				}
+				mm_hcompact(HANDLE_BUDGET);
+				break;
+
+			default:
+				app_error("trace %d: Nonexistent request type in eval_mm_util_handles",
+						tracenum);
+		}
+
+		/* update the high-water mark */
+		max_total_size = (total_size > max_total_size) ?
+			total_size : max_total_size;
+	}
+
+	free(handles);
+	printf(".");
+
+	return ((double)max_total_size / (double)mem_peaksize());
+}
+
+/*
+ * replay_ops, replay_packed - replay trace through the four calls
+ *    given. Always inlined with the calls known, so eval_mm_speed and
+ *    eval_null_speed time the same loop around different allocators.
+ */
+static inline __attribute__((always_inline)) void replay_ops(trace_t *trace,
+		void *(*do_malloc)(size_t), void *(*do_memalign)(size_t, size_t),
+		void *(*do_realloc)(void *, size_t), void (*do_free)(void *))
+{
+	int i, index;
+	size_t size, newsize;
+	char *p, *newp, *oldp, *block;
 
 	/* Interpret each trace request */
 	for (i = 0;  i < trace->num_ops;  i++)
@@ -1095,16 +1490,24 @@ static void eval_mm_speed(void *ptr)
 			case ALLOC: /* mm_malloc */
 				index = trace->ops[i].index;
 				size = trace->ops[i].size;
-				if ((p = mm_malloc(size)) == NULL)
+				if ((p = do_malloc(size)) == NULL)
 					app_error("mm_malloc error in eval_mm_speed");
 				trace->blocks[index] = p;
 				break;
 
+			case MEMALIGN: /* mm_memalign */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if ((p = do_memalign(trace->ops[i].align, size)) == NULL)
+					app_error("mm_memalign error in eval_mm_speed");
+				trace->blocks[index] = p;
+				break;
+
 			case REALLOC: /* mm_realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
 				oldp = trace->blocks[index];
-				if ((newp = mm_realloc(oldp,newsize)) == NULL && newsize != 0)
+				if ((newp = do_realloc(oldp,newsize)) == NULL && newsize != 0)
 					app_error("mm_realloc error in eval_mm_speed");
 				trace->blocks[index] = newp;
 				break;
@@ -1116,7 +1519,7 @@ static void eval_mm_speed(void *ptr)
 				} else {
 					block = trace->blocks[index];
 				}
-				mm_free(block);
+				do_free(block);
 				break;
 
 			default:
@@ -1124,6 +1527,151 @@ static void eval_mm_speed(void *ptr)
 		}
 }
 
+/*
+ * The packed requests keep the driver's share of the timed loop small:
+ * half the bytes to walk, and the block slots PACK_AHEAD requests on are
+ * fetched while the allocator works on this one.
+ */
+static inline __attribute__((always_inline)) void replay_packed(
+		trace_t *trace,
+		void *(*do_malloc)(size_t), void *(*do_memalign)(size_t, size_t),
+		void *(*do_realloc)(void *, size_t), void (*do_free)(void *))
+{
+	const packop_t *op, *end = trace->packed + trace->num_ops;
+	char **blocks = trace->blocks, **slot, *p;
+
+	for (op = trace->packed; op < end; op++) {
+		__builtin_prefetch(&blocks[PACK_INDEX(op[PACK_AHEAD])], 1);
+		slot = &blocks[PACK_INDEX(*op)];
+		switch (PACK_TYPE(*op)) {
+			case ALLOC:
+				if ((*slot = do_malloc(op->size)) == NULL)
+					app_error("mm_malloc error in eval_mm_speed");
+				break;
+
+			case MEMALIGN:
+				if ((*slot = do_memalign((size_t)1 << PACK_SHIFT(*op),
+								op->size)) == NULL)
+					app_error("mm_memalign error in eval_mm_speed");
+				break;
+
+			case REALLOC:
+				if ((p = do_realloc(*slot, op->size)) == NULL && op->size != 0)
+					app_error("mm_realloc error in eval_mm_speed");
+				*slot = p;
+				break;
+
+			case FREE:
+				do_free(*slot);
+				break;
+		}
+	}
+}
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+	trace_t *trace = ((speed_t *)ptr)->trace;
+	reinit_trace(trace);
+
+	/* Reset the heap and initialize the mm package */
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_speed");
+
+	if (trace->packed != NULL)
+		replay_packed(trace, mm_malloc, mm_memalign, mm_realloc, mm_free);
+	else
+		replay_ops(trace, mm_malloc, mm_memalign, mm_realloc, mm_free);
+}
+
+/*
+ * eval_mm_startup - the secs mm_init takes at the start of each
+ *    eval_mm_speed run, which short traces would otherwise blend into
+ *    their Kops. Only mm_init is timed: emptying the heap before it is
+ *    the harness's, and -C counts it there. Returns the best of
+ *    STARTUP_SAMPLES tries, less what reading the clock costs.
+ */
+#define STARTUP_SAMPLES 50
+static double eval_mm_startup(void)
+{
+	double t, best = DBL_MAX, clock = DBL_MAX;
+	int i;
+
+	for (i = 0; i < STARTUP_SAMPLES; i++) {
+		mem_reset_brk();
+		t = bench_nsecs();
+		if (mm_init() < 0)
+			app_error("mm_init failed in eval_mm_startup");
+		t = bench_nsecs() - t;
+		if (t < best)
+			best = t;
+		t = bench_nsecs();
+		t = bench_nsecs() - t;
+		if (t < clock)
+			clock = t;
+	}
+	return best > clock ? (best - clock) / 1e9 : 0;
+}
+
+/*
+ * The null allocator, for timing the harness (-C): it hands out
+ * addresses from a bump pointer and never frees or touches a byte.
+ * The driver doesn't write to blocks while timing, so nothing has
+ * to be behind them.
+ */
+#define NULL_BASE ((char *)4096)
+static char *null_brk;
+
+static __attribute__((noinline)) void *null_malloc(size_t size)
+{
+	char *p = null_brk;
+
+	null_brk += (size + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+	return p;
+}
+
+static __attribute__((noinline)) void *null_memalign(size_t align,
+		size_t size)
+{
+	null_brk = (char *)(((uintptr_t)null_brk + align - 1) & ~(align - 1));
+	return null_malloc(size);
+}
+
+static __attribute__((noinline)) void *null_realloc(void *ptr, size_t size)
+{
+	(void)ptr;
+	return null_malloc(size);
+}
+
+static __attribute__((noinline)) void null_free(void *ptr)
+{
+	__asm__ volatile("" : : "r"(ptr));
+}
+
+/*
+ * eval_null_speed - eval_mm_speed on the null allocator, which is what
+ *    the harness costs: reinit_trace, mem_reset_brk and the replay
+ */
+static void eval_null_speed(void *ptr)
+{
+	trace_t *trace = ((speed_t *)ptr)->trace;
+	reinit_trace(trace);
+
+	mem_reset_brk();
+	null_brk = NULL_BASE;
+
+	if (trace->packed != NULL)
+		replay_packed(trace, null_malloc, null_memalign, null_realloc,
+				null_free);
+	else
+		replay_ops(trace, null_malloc, null_memalign, null_realloc,
+				null_free);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1132,7 +1680,8 @@ static void eval_mm_speed(void *ptr)
  */
 static int eval_libc_valid(trace_t *trace)
 {
-	int i, newsize;
+	int i;
+	size_t newsize;
 	char *p, *newp, *oldp;
 
 	reinit_trace(trace);
@@ -1148,6 +1697,15 @@ static int eval_libc_valid(trace_t *trace)
 				trace->blocks[trace->ops[i].index] = p;
 				break;
 
+			case MEMALIGN: /* posix_memalign */
+				if (posix_memalign((void **)&p, trace->ops[i].align,
+							trace->ops[i].size) != 0) {
+					malloc_error(trace, i, "libc posix_memalign failed");
+					unix_error("System message");
+				}
+				trace->blocks[trace->ops[i].index] = p;
+				break;
+
 			case REALLOC: /* realloc */
 				newsize = trace->ops[i].size;
 				oldp = trace->blocks[trace->ops[i].index];
@@ -1182,7 +1740,8 @@ static int eval_libc_valid(trace_t *trace)
 static void eval_libc_speed(void *ptr)
 {
 	int i;
-	int index, size, newsize;
+	int index;
+	size_t size, newsize;
 	char *p, *newp, *oldp, *block;
 	trace_t *trace = ((speed_t *)ptr)->trace;
 
@@ -1198,6 +1757,14 @@ static void eval_libc_speed(void *ptr)
 				trace->blocks[index] = p;
 				break;
 
+			case MEMALIGN: /* posix_memalign */
+				index = trace->ops[i].index;
+				size = trace->ops[i].size;
+				if (posix_memalign((void **)&p, trace->ops[i].align, size) != 0)
+					unix_error("posix_memalign failed in eval_libc_speed");
+				trace->blocks[index] = p;
+				break;
+
 			case REALLOC: /* realloc */
 				index = trace->ops[i].index;
 				newsize = trace->ops[i].size;
@@ -1221,29 +1788,1344 @@ static void eval_libc_speed(void *ptr)
 	}
 }
 
-/*************************************
- * Some miscellaneous helper routines
+/*****************************************************************
+ * Streaming replay (-S). A reader thread parses the trace into one
+ * of two buffers of STREAM_CHUNK requests while mm replays the other,
+ * and ids map to blocks through a hash table of the live ones, so
+ * memory goes with the live set and not with the trace's length.
+ ****************************************************************/
+
+#define STREAM_CHUNK (1<<16) /* requests per buffer */
+#define LIVE_MIN     1024    /* least slots in the live table */
+
+typedef struct {
+	FILE *file;
+	const char *filename;
+	int binary;              /* records as in a binary trace, not text */
+	long left;               /* requests still to read */
+	long done;               /* requests read so far */
+	long index;              /* text requests take missing numbers */
+	int align;               /* ... from the request before */
+	size_t size;
+	traceop_t *buf[2];
+	int len[2];              /* requests in buf[i], 0 at the end, -1 if free */
+	double stalled;          /* ns the replay waited for the reader */
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+} stream_t;
+
+/* A live block, id -1 marks a free slot */
+typedef struct {
+	long id;
+	char *p;
+	size_t size;
+} live_t;
+
+static live_t *live;         /* open addressing, linear probing */
+static size_t live_slots;    /* a power of 2 */
+static size_t live_count;
+
+/* live_home - the slot id hashes to */
+static size_t live_home(long id)
+{
+	return ((unsigned long)id * 0x9E3779B97F4A7C15UL) >> 20 & (live_slots - 1);
+}
+
+/* live_find - the slot holding id, or the free slot where it would go */
+static live_t *live_find(long id)
+{
+	size_t i = live_home(id);
+
+	while (live[i].id != id && live[i].id != -1)
+		i = (i + 1) & (live_slots - 1);
+	return &live[i];
+}
+
+/* live_resize - rehash the live table into slots slots */
+static void live_resize(size_t slots)
+{
+	live_t *old = live;
+	size_t i, old_slots = live_slots;
+
+	if ((live = malloc(slots * sizeof(live_t))) == NULL)
+		unix_error("malloc failed in live_resize");
+	live_slots = slots;
+	for (i = 0; i < slots; i++)
+		live[i].id = -1;
+	for (i = 0; i < old_slots; i++)
+		if (old[i].id != -1)
+			*live_find(old[i].id) = old[i];
+	free(old);
+}
+
+/* live_put - remember block p of size bytes as id */
+static void live_put(long id, char *p, size_t size)
+{
+	live_t *l = live_find(id);
+
+	if (l->id == -1) {
+		if (2 * ++live_count > live_slots) {
+			live_resize(2 * live_slots);
+			l = live_find(id);
+		}
+		l->id = id;
+	}
+	l->p = p;
+	l->size = size;
+}
+
+/* live_drop - forget id, shifting back the slots that probed past it */
+static void live_drop(live_t *l)
+{
+	size_t i = l - live, j = i, home;
+
+	live_count--;
+	for (;;) {
+		j = (j + 1) & (live_slots - 1);
+		if (live[j].id == -1)
+			break;
+		home = live_home(live[j].id);
+		/* live[j] can move to i unless its home is cyclically in (i, j] */
+		if ((j > i && (home <= i || home > j)) ||
+				(j < i && home <= i && home > j)) {
+			live[i] = live[j];
+			i = j;
+		}
+	}
+	live[i].id = -1;
+}
+
+/* stream_fill - read up to STREAM_CHUNK requests into ops */
+static int stream_fill(stream_t *st, traceop_t *ops)
+{
+	char type[MAXLINE];
+	int n = 0, got = 0;
+
+	if (st->binary)
+		n = fread(ops, sizeof(traceop_t),
+				st->left < STREAM_CHUNK ? st->left : STREAM_CHUNK, st->file);
+	else
+		for (; n < STREAM_CHUNK && n < st->left &&
+				fscanf(st->file, "%s", type) != EOF; n++) {
+			/* a number missing from the end of a request is taken from
+			   the one before, but there must be an id */
+			switch (type[0]) {
+				case 'a':
+					got = fscanf(st->file, "%ld %zu", &st->index, &st->size);
+					ops[n].type = ALLOC;
+					break;
+				case 'r':
+					got = fscanf(st->file, "%ld %zu", &st->index, &st->size);
+					ops[n].type = REALLOC;
+					break;
+				case 'm':
+					got = fscanf(st->file, "%ld %zu %d", &st->index, &st->size,
+							&st->align);
+					if (st->align <= 0 || (st->align & (st->align - 1)) != 0)
+						app_error("%s: memalign alignment %d is not a power of 2",
+								st->filename, st->align);
+					ops[n].type = MEMALIGN;
+					ops[n].align = st->align;
+					break;
+				case 'f':
+					got = fscanf(st->file, "%ld", &st->index);
+					ops[n].type = FREE;
+					break;
+				default:
+					app_error("Bogus type character (%c) in tracefile %s\n",
+							type[0], st->filename);
+			}
+			if (got < 1)
+				app_error("%s: request %ld has no block id", st->filename,
+						st->done + n);
+			if (st->index < (ops[n].type == FREE ? -1 : 0))
+				app_error("%s: bad block id %ld", st->filename, st->index);
+			ops[n].index = st->index;
+			ops[n].size = st->size;
+		}
+	st->left -= n;
+	st->done += n;
+	return n;
+}
+
+/*
+ * stream_reader - the reader thread: fill whichever buffer is free
+ *     until the trace runs out, then hand over an empty one
+ */
+static void *stream_reader(void *arg)
+{
+	stream_t *st = arg;
+	int b = 0, n;
+
+	do {
+		pthread_mutex_lock(&st->lock);
+		while (st->len[b] != -1)
+			pthread_cond_wait(&st->changed, &st->lock);
+		pthread_mutex_unlock(&st->lock);
+
+		n = stream_fill(st, st->buf[b]);
+
+		pthread_mutex_lock(&st->lock);
+		st->len[b] = n;
+		pthread_cond_broadcast(&st->changed);
+		pthread_mutex_unlock(&st->lock);
+		b ^= 1;
+	} while (n > 0);
+	return NULL;
+}
+
+/* stream_next - wait for buffer b to be filled, returns its length */
+static int stream_next(stream_t *st, int b)
+{
+	double t = bench_nsecs();
+	int n;
+
+	pthread_mutex_lock(&st->lock);
+	while ((n = st->len[b]) == -1)
+		pthread_cond_wait(&st->changed, &st->lock);
+	pthread_mutex_unlock(&st->lock);
+	st->stalled += bench_nsecs() - t;
+	return n;
+}
+
+/* stream_done - give buffer b back to the reader */
+static void stream_done(stream_t *st, int b)
+{
+	pthread_mutex_lock(&st->lock);
+	st->len[b] = -1;
+	pthread_cond_broadcast(&st->changed);
+	pthread_mutex_unlock(&st->lock);
+}
+
+/*
+ * eval_mm_stream - replay the trace in filename (text or binary) through
+ *     mm once without loading it, and report its speed and utilization
+ */
+static void eval_mm_stream(const char *filename)
+{
+	stream_t st;
+	tracehdr_t hdr;
+	pthread_t reader;
+	traceop_t *op;
+	live_t *l;
+	char *p;
+	double t, ops = 0;
+	size_t payload = 0, max_payload = 0, max_live = 0;
+	int b = 0, i, n;
+
+	memset(&st, 0, sizeof(st));
+	st.filename = filename;
+	if ((st.file = fopen(filename, "r")) == NULL)
+		unix_error("Could not open %s in eval_mm_stream", filename);
+	if (fread(&hdr, sizeof(hdr), 1, st.file) == 1 &&
+			memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic) - 1) == 0) {
+		if (memcmp(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic)) != 0 ||
+				hdr.op_size != sizeof(traceop_t))
+			app_error("%s: written by another version or machine, convert it again",
+					filename);
+		st.binary = 1;
+		st.left = hdr.num_ops;
+	} else {
+		rewind(st.file);
+		if (fscanf(st.file, "%d %ld %ld %d", &hdr.weight, &hdr.num_ids,
+					&st.left, &hdr.ignore_ranges) != 4)
+			app_error("%s: bad trace header", filename);
+	}
+	for (i = 0; i < 2; i++) {
+		if ((st.buf[i] = malloc(STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+			unix_error("malloc failed in eval_mm_stream");
+		st.len[i] = -1;
+	}
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.changed, NULL);
+	live_slots = 0;
+	live_count = 0;
+	live = NULL;
+	live_resize(LIVE_MIN);
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in eval_mm_stream");
+	if (pthread_create(&reader, NULL, stream_reader, &st) != 0)
+		app_error("pthread_create failed in eval_mm_stream");
+	t = bench_nsecs();
+	while ((n = stream_next(&st, b)) > 0) {
+		for (op = st.buf[b]; op < st.buf[b] + n; op++) {
+			switch (op->type) {
+				case ALLOC:
+				case MEMALIGN:
+					p = op->type == ALLOC ? mm_malloc(op->size) :
+						mm_memalign(op->align, op->size);
+					if (p == NULL)
+						app_error("mm_malloc failed in eval_mm_stream");
+					live_put(op->index, p, op->size);
+					payload += op->size;
+					break;
+
+				case REALLOC:
+					l = live_find(op->index);
+					if (l->id == -1) {
+						p = mm_realloc(NULL, op->size);
+					} else {
+						p = mm_realloc(l->p, op->size);
+						payload -= l->size;
+					}
+					if (p == NULL && op->size != 0)
+						app_error("mm_realloc failed in eval_mm_stream");
+					if (op->size != 0)
+						live_put(op->index, p, op->size);
+					else if (l->id != -1)	/* realloc to 0 freed it */
+						live_drop(l);
+					payload += op->size;
+					break;
+
+				case FREE:
+					l = op->index < 0 ? NULL : live_find(op->index);
+					if (l == NULL || l->id == -1) {
+						mm_free(NULL);
+					} else {
+						mm_free(l->p);
+						payload -= l->size;
+						live_drop(l);
+					}
+					break;
+			}
+			if (payload > max_payload)
+				max_payload = payload;
+			if (live_count > max_live)
+				max_live = live_count;
+		}
+		ops += n;
+		stream_done(&st, b);
+		b ^= 1;
+	}
+	t = bench_nsecs() - t;
+	pthread_join(reader, NULL);
+
+	printf("%s: %.0f ops in %.3f secs, %.0f Kops (%.3f secs waiting on the reader)\n",
+			filename, ops, t / 1e9, ops / 1e3 / (t / 1e9), st.stalled / 1e9);
+	printf("util %.0f%%, most ids live %zu, live table %zu KB\n",
+			mem_peaksize() ? 100.0 * max_payload / mem_peaksize() : 0.0,
+			max_live, live_slots * sizeof(live_t) / 1024);
+
+	fclose(st.file);
+	free(st.buf[0]);
+	free(st.buf[1]);
+	free(live);
+	pthread_mutex_destroy(&st.lock);
+	pthread_cond_destroy(&st.changed);
+}
+
+/*****************************************************************
+ * Microbenchmarks. Each one sets up its own heap and times two or
+ * more ways of doing the same work through the mm package.
+ ****************************************************************/
+
+/* The microbenchmarks, selected by name with -b */
+static bench_t benches[] = {
+	{"cache", bench_cache},
+	{"sized", bench_sized},
+	{"usable", bench_usable},
+	{"batch", bench_batch},
+	{"calloc", bench_calloc},
+	{"zpool", bench_zpool},
+	{"copy", bench_copy},
+	{"mremap", bench_mremap},
+	{"mesh", bench_mesh},
+	{"persist", bench_persist},
+	{"shared", bench_shared},
+	{"regions", bench_regions},
+	{"heaps", bench_heaps},
+	{NULL, NULL}
+};
+
+/*
+ * run_bench - run the microbenchmark called name
+ */
+static void run_bench(const char *name)
+{
+	bench_t *b;
+
+	for (b = benches; b->name != NULL; b++) {
+		if (strcmp(b->name, name) == 0) {
+			mem_init();
+			b->run();
+			mem_deinit();
+			return;
+		}
+	}
+	app_error("Unknown microbenchmark %s\n", name);
+}
+
+/* An object whose construction is much dearer than its allocation */
+typedef struct bench_obj_t {
+	struct bench_obj_t *next;  /* embedded list, points to self when idle */
+	struct bench_obj_t *prev;
+	long lock;
+	long table[29];
+} bench_obj_t;
+
+static void bench_obj_ctor(void *p)
+{
+	bench_obj_t *obj = p;
+	int i;
+
+	obj->next = obj->prev = obj;
+	obj->lock = 0;
+	for (i = 0; i < 29; i++)
+		obj->table[i] = (long)i * i;
+}
+
+static void bench_obj_dtor(void *p)
+{
+	bench_obj_t *obj = p;
+	obj->next = obj->prev = NULL;
+}
+
+/*
+ * bench_cache_speed - churn constructed objects through an object cache
+ */
+static void bench_cache_speed(void *ptr __attribute__((unused)))
+{
+	static bench_obj_t *live[BENCH_LIVE];
+	mm_cache_t *cache;
+	int i, slot;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_cache_speed");
+	cache = mm_cache_create(sizeof(bench_obj_t), 0,
+			bench_obj_ctor, bench_obj_dtor);
+	if (cache == NULL)
+		app_error("mm_cache_create failed in bench_cache_speed");
+
+	for (i = 0; i < BENCH_LIVE; i++)
+		if ((live[i] = mm_cache_alloc(cache)) == NULL)
+			app_error("mm_cache_alloc failed in bench_cache_speed");
+	for (i = 0; i < BENCH_OPS; i++) {
+		slot = (i * 7919) % BENCH_LIVE;
+		mm_cache_free(cache, live[slot]);
+		if ((live[slot] = mm_cache_alloc(cache)) == NULL)
+			app_error("mm_cache_alloc failed in bench_cache_speed");
+	}
+}
+
+/*
+ * bench_malloc_speed - the same churn, constructing on every mm_malloc
+ *     and destructing on every mm_free
+ */
+static void bench_malloc_speed(void *ptr __attribute__((unused)))
+{
+	static bench_obj_t *live[BENCH_LIVE];
+	int i, slot;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_malloc_speed");
+
+	for (i = 0; i < BENCH_LIVE; i++) {
+		if ((live[i] = mm_malloc(sizeof(bench_obj_t))) == NULL)
+			app_error("mm_malloc failed in bench_malloc_speed");
+		bench_obj_ctor(live[i]);
+	}
+	for (i = 0; i < BENCH_OPS; i++) {
+		slot = (i * 7919) % BENCH_LIVE;
+		bench_obj_dtor(live[slot]);
+		mm_free(live[slot]);
+		if ((live[slot] = mm_malloc(sizeof(bench_obj_t))) == NULL)
+			app_error("mm_malloc failed in bench_malloc_speed");
+		bench_obj_ctor(live[slot]);
+	}
+}
+
+/*
+ * bench_cache - object cache vs mm_malloc/mm_free with construction
+ */
+static void bench_cache(void)
+{
+	double ops = BENCH_LIVE + 2.0 * BENCH_OPS;
+	double cache_secs = fsecs(bench_cache_speed, NULL);
+	double malloc_secs = fsecs(bench_malloc_speed, NULL);
+
+	printf("%-24s%10.6f secs %8.0f Kops\n", "mm_cache_alloc/free",
+			cache_secs, (ops/1e3)/cache_secs);
+	printf("%-24s%10.6f secs %8.0f Kops\n", "mm_malloc/free + ctor",
+			malloc_secs, (ops/1e3)/malloc_secs);
+}
+
+/* Request size for the i'th allocation of a churn benchmark */
+#define BENCH_SIZE(i) (16 + ((i) * 37) % 240)
+
+/*
+ * bench_churn_speed - keep BENCH_LIVE blocks of mixed sizes live and
+ *     replace them BENCH_OPS times. ptr is nonzero for mm_free_sized.
+ */
+static void bench_churn_speed(void *ptr)
+{
+	static char *live[BENCH_LIVE];
+	static size_t sizes[BENCH_LIVE];
+	int sized = *(int *)ptr;
+	int i, slot;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_churn_speed");
+
+	for (i = 0; i < BENCH_LIVE; i++) {
+		sizes[i] = BENCH_SIZE(i);
+		if ((live[i] = mm_malloc(sizes[i])) == NULL)
+			app_error("mm_malloc failed in bench_churn_speed");
+	}
+	for (i = 0; i < BENCH_OPS; i++) {
+		slot = (i * 7919) % BENCH_LIVE;
+		if (sized)
+			mm_free_sized(live[slot], sizes[slot]);
+		else
+			mm_free(live[slot]);
+		sizes[slot] = BENCH_SIZE(i);
+		if ((live[slot] = mm_malloc(sizes[slot])) == NULL)
+			app_error("mm_malloc failed in bench_churn_speed");
+	}
+}
+
+/*
+ * bench_sized - mm_free against mm_free_sized on the same churn
+ */
+static void bench_sized(void)
+{
+	double ops = BENCH_LIVE + 2.0 * BENCH_OPS;
+	int sized = 0;
+	double free_secs = fsecs(bench_churn_speed, &sized);
+	double sized_secs;
+
+	sized = 1;
+	sized_secs = fsecs(bench_churn_speed, &sized);
+	printf("%-24s%10.6f secs %8.0f Kops\n", "mm_malloc/free",
+			free_secs, (ops/1e3)/free_secs);
+	printf("%-24s%10.6f secs %8.0f Kops\n", "mm_malloc/free_sized",
+			sized_secs, (ops/1e3)/sized_secs);
+}
+
+/* Growth benchmark: BENCH_LIVE buffers appended to BENCH_APPENDS times */
+#define BENCH_APPENDS 512
+#define BENCH_ITEM    24     /* bytes per append */
+
+static long bench_reallocs; /* reallocs made by the last growth run */
+
+/*
+ * bench_grow_speed - grow buffers 1.5x at a time whenever they fill.
+ *     ptr is nonzero to size capacity from mm_good_size and
+ *     mm_malloc_usable_size instead of from the requested bytes.
+ */
+static void bench_grow_speed(void *ptr)
+{
+	static char *bufs[BENCH_LIVE];
+	static size_t caps[BENCH_LIVE];
+	int aware = *(int *)ptr;
+	size_t len;
+	int i, j;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_grow_speed");
+	bench_reallocs = 0;
+
+	for (i = 0; i < BENCH_LIVE; i++) {
+		caps[i] = aware ? mm_good_size(BENCH_ITEM) : BENCH_ITEM;
+		if ((bufs[i] = mm_malloc(caps[i])) == NULL)
+			app_error("mm_malloc failed in bench_grow_speed");
+	}
+	for (j = 0; j < BENCH_APPENDS; j++) {
+		len = (size_t)j * BENCH_ITEM;
+		for (i = 0; i < BENCH_LIVE; i++) {
+			if (len + BENCH_ITEM > caps[i]) {
+				caps[i] += caps[i] / 2;
+				if ((bufs[i] = mm_realloc(bufs[i], caps[i])) == NULL)
+					app_error("mm_realloc failed in bench_grow_speed");
+				if (aware)
+					caps[i] = mm_malloc_usable_size(bufs[i]);
+				bench_reallocs++;
+			}
+			bufs[i][len] = (char)j;
+		}
+	}
+}
+
+/*
+ * bench_usable - growable buffers with and without size feedback
+ */
+static void bench_usable(void)
+{
+	int aware = 0;
+	double plain_secs = fsecs(bench_grow_speed, &aware);
+	long plain_reallocs = bench_reallocs;
+	double aware_secs;
+
+	aware = 1;
+	aware_secs = fsecs(bench_grow_speed, &aware);
+	printf("%-24s%10.6f secs %8ld reallocs\n", "requested capacity",
+			plain_secs, plain_reallocs);
+	printf("%-24s%10.6f secs %8ld reallocs\n", "usable capacity",
+			aware_secs, bench_reallocs);
+}
+
+/* Batch benchmark: BENCH_GROUPS groups of BENCH_GROUP blocks each */
+#define BENCH_GROUP  128
+#define BENCH_GROUPS (BENCH_LIVE / BENCH_GROUP)
+
+/*
+ * bench_group_speed - replace whole groups of same-size blocks, one
+ *     group at a time. ptr is nonzero to use mm_malloc_batch and
+ *     mm_free_batch instead of one call per block.
+ */
+static void bench_group_speed(void *ptr)
+{
+	static void *groups[BENCH_GROUPS][BENCH_GROUP];
+	int batch = *(int *)ptr;
+	size_t size;
+	int g, i, j;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_group_speed");
+	memset(groups, 0, sizeof(groups));
+
+	for (i = 0; i < BENCH_OPS / BENCH_GROUP; i++) {
+		g = i % BENCH_GROUPS;
+		size = BENCH_SIZE(i);
+		if (batch) {
+			mm_free_batch(groups[g], BENCH_GROUP);
+			if (mm_malloc_batch(size, BENCH_GROUP, groups[g]) != BENCH_GROUP)
+				app_error("mm_malloc_batch failed in bench_group_speed");
+		} else {
+			for (j = 0; j < BENCH_GROUP; j++)
+				mm_free(groups[g][j]);
+			for (j = 0; j < BENCH_GROUP; j++)
+				if ((groups[g][j] = mm_malloc(size)) == NULL)
+					app_error("mm_malloc failed in bench_group_speed");
+		}
+	}
+}
+
+/*
+ * bench_batch - one call per block against the batch entry points
+ */
+static void bench_batch(void)
+{
+	double ops = 2.0 * (BENCH_OPS / BENCH_GROUP) * BENCH_GROUP;
+	int batch = 0;
+	double single_secs = fsecs(bench_group_speed, &batch);
+	double batch_secs;
+
+	batch = 1;
+	batch_secs = fsecs(bench_group_speed, &batch);
+	printf("%-24s%10.6f secs %8.0f Kops\n", "mm_malloc/free",
+			single_secs, (ops/1e3)/single_secs);
+	printf("%-24s%10.6f secs %8.0f Kops\n", "mm_malloc/free_batch",
+			batch_secs, (ops/1e3)/batch_secs);
+}
+
+/* calloc benchmark: zeroed buffers that are only partly written */
+#define BENCH_BUF    (4<<20)
+#define BENCH_BUFS   64
+
+/*
+ * bench_zero_speed - get BENCH_BUFS zeroed buffers one after another,
+ *     write one line of each and free it. ptr is nonzero for
+ *     mm_calloc, zero for mm_malloc followed by memset.
+ */
+static void bench_zero_speed(void *ptr)
+{
+	int use_calloc = *(int *)ptr;
+	char *buf;
+	int i;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_zero_speed");
+
+	for (i = 0; i < BENCH_BUFS; i++) {
+		if (use_calloc) {
+			if ((buf = mm_calloc(1, BENCH_BUF)) == NULL)
+				app_error("mm_calloc failed in bench_zero_speed");
+		} else {
+			if ((buf = mm_malloc(BENCH_BUF)) == NULL)
+				app_error("mm_malloc failed in bench_zero_speed");
+			memset(buf, 0, BENCH_BUF);
+		}
+		buf[(i * 4099) % BENCH_BUF] = 1;
+		mm_free(buf);
+	}
+}
+
+/*
+ * bench_calloc - mm_calloc against mm_malloc plus memset
+ */
+static void bench_calloc(void)
+{
+	int use_calloc = 0;
+	double memset_secs = fsecs(bench_zero_speed, &use_calloc);
+	double calloc_secs;
+
+	use_calloc = 1;
+	calloc_secs = fsecs(bench_zero_speed, &use_calloc);
+	printf("%-24s%10.6f secs %8.1f us/call\n", "mm_malloc + memset",
+			memset_secs, memset_secs * 1e6 / BENCH_BUFS);
+	printf("%-24s%10.6f secs %8.1f us/call\n", "mm_calloc",
+			calloc_secs, calloc_secs * 1e6 / BENCH_BUFS);
+}
+
+static double bench_calloc_nsecs; /* time inside mm_calloc, last run */
+
+/* Nanoseconds on the monotonic clock, for timing single calls inside
+ * a run that fsecs is already timing */
+static double bench_nsecs(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * bench_zchurn_speed - keep BENCH_LIVE/4 zeroed buffers of 4K to 128K
+ *     live, replacing one at a time with a new mm_calloc that the
+ *     caller then fills. ptr is nonzero to turn the pre-zeroed pool on.
+ */
+static void bench_zchurn_speed(void *ptr)
+{
+	static char *live[BENCH_LIVE / 4];
+	static size_t sizes[BENCH_LIVE / 4];
+	int pool = *(int *)ptr;
+	int i, slot;
+	double t;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_zchurn_speed");
+	mm_zpool_enable(pool);
+	bench_calloc_nsecs = 0;
+
+	for (i = 0; i < BENCH_LIVE / 4; i++) {
+		sizes[i] = 4096 << (i % 6);
+		if ((live[i] = mm_calloc(1, sizes[i])) == NULL)
+			app_error("mm_calloc failed in bench_zchurn_speed");
+	}
+	for (i = 0; i < BENCH_OPS; i++) {
+		slot = (i * 7919) % (BENCH_LIVE / 4);
+		mm_free(live[slot]);
+		t = bench_nsecs();
+		live[slot] = mm_calloc(1, sizes[slot]);
+		bench_calloc_nsecs += bench_nsecs() - t;
+		if (live[slot] == NULL)
+			app_error("mm_calloc failed in bench_zchurn_speed");
+		memset(live[slot], 0xff, sizes[slot]);
+	}
+	mm_zpool_enable(0);
+}
+
+/*
+ * bench_zpool - calloc latency with and without the pre-zeroed pool
+ */
+static void bench_zpool(void)
+{
+	int pool = 0;
+	double plain_secs = fsecs(bench_zchurn_speed, &pool);
+	double plain_nsecs = bench_calloc_nsecs;
+	double pool_secs;
+
+	pool = 1;
+	pool_secs = fsecs(bench_zchurn_speed, &pool);
+	printf("%-24s%10.6f secs %8.1f ns/calloc\n", "no pool",
+			plain_secs, plain_nsecs / BENCH_OPS);
+	printf("%-24s%10.6f secs %8.1f ns/calloc\n", "pre-zeroed pool",
+			pool_secs, bench_calloc_nsecs / BENCH_OPS);
+}
+
+/* Copy sizes, from realloc.rep's small growing buffers up to past the
+ * last level cache */
+static size_t bench_copy_sizes[] = {16, 48, 200, 512, 1024, 16384, 262144, 32<<20};
+#define BENCH_COPY_BYTES (256<<20) /* bytes moved per run */
+
+typedef struct {
+	char *dst, *src;
+	size_t size;
+	int use_mm;   /* mm_copy/mm_zero instead of memcpy/memset */
+	int zero;     /* zero dst instead of copying src to it */
+} copy_params_t;
+
+/*
+ * bench_copy_speed - move BENCH_COPY_BYTES in copies of one size,
+ *     alternating between two halves of dst as realloc would
+ */
+static void bench_copy_speed(void *ptr)
+{
+	copy_params_t *p = ptr;
+	size_t reps = BENCH_COPY_BYTES / p->size;
+	size_t i;
+
+	for (i = 0; i < reps; i++) {
+		char *dst = p->dst + (i & 1) * p->size;
+		if (p->zero && p->use_mm)
+			mm_zero(dst, p->size);
+		else if (p->zero)
+			memset(dst, 0, p->size);
+		else if (p->use_mm)
+			mm_copy(dst, p->src, p->size);
+		else
+			memcpy(dst, p->src, p->size);
+	}
+}
+
+/*
+ * bench_copy - mm_copy and mm_zero against libc over block sizes
+ */
+static void bench_copy(void)
+{
+	size_t max = bench_copy_sizes[sizeof(bench_copy_sizes) /
+		sizeof(bench_copy_sizes[0]) - 1];
+	copy_params_t p;
+	double secs[4];
+	unsigned int i;
+	int j;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_copy");
+	if ((p.src = malloc(max)) == NULL || (p.dst = malloc(2 * max)) == NULL)
+		unix_error("malloc failed in bench_copy");
+	memset(p.src, 0x5a, max);
+	memset(p.dst, 0, 2 * max);
+
+	printf("%10s %12s %12s %12s %12s   (GB/s)\n", "size",
+			"memcpy", "mm_copy", "memset", "mm_zero");
+	for (i = 0; i < sizeof(bench_copy_sizes) / sizeof(bench_copy_sizes[0]); i++) {
+		p.size = bench_copy_sizes[i];
+		for (j = 0; j < 4; j++) {
+			p.zero = j / 2;
+			p.use_mm = j % 2;
+			secs[j] = fsecs(bench_copy_speed, &p);
+		}
+		printf("%10lu", (unsigned long)p.size);
+		for (j = 0; j < 4; j++)
+			printf(" %12.2f", BENCH_COPY_BYTES / secs[j] / 1e9);
+		printf("\n");
+	}
+	free(p.src);
+	free(p.dst);
+}
+
+#define BENCH_HUGE_STEP  (1<<20)  /* bytes added per realloc */
+#define BENCH_HUGE_STEPS 64
+#define BENCH_HUGE_BAND  8        /* steps averaged at each end */
+
+static double bench_huge_nsecs[BENCH_HUGE_STEPS];
+
+/*
+ * bench_huge_speed - grow one buffer a megabyte at a time up to 64MB, 
+ *     writing its new last byte each time. ptr is nonzero to grow it
+ *     by hand with mm_malloc, memcpy and mm_free instead of mm_realloc.
+ */
+static void bench_huge_speed(void *ptr)
+{
+	int by_hand = *(int *)ptr;
+	size_t size = BENCH_HUGE_STEP;
+	char *buf, *newbuf;
+	double t;
+	int i;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_huge_speed");
+	if ((buf = mm_malloc(size)) == NULL)
+		app_error("mm_malloc failed in bench_huge_speed");
+	buf[size - 1] = 1;
+
+	for (i = 0; i < BENCH_HUGE_STEPS; i++) {
+		t = bench_nsecs();
+		if (by_hand) {
+			if ((newbuf = mm_malloc(size + BENCH_HUGE_STEP)) != NULL) {
+				memcpy(newbuf, buf, size);
+				mm_free(buf);
+			}
+		} else
+			newbuf = mm_realloc(buf, size + BENCH_HUGE_STEP);
+		bench_huge_nsecs[i] = bench_nsecs() - t;
+		if (newbuf == NULL)
+			app_error("growing failed in bench_huge_speed");
+		buf = newbuf;
+		size += BENCH_HUGE_STEP;
+		buf[size - 1] = 1;
+	}
+	mm_free(buf);
+}
+
+/*
+ * bench_mremap - cost of growing a huge buffer, small end against big
+ */
+static void bench_mremap(void)
+{
+	double small, big;
+	int by_hand, i;
+
+	for (by_hand = 1; by_hand >= 0; by_hand--) {
+		fsecs(bench_huge_speed, &by_hand);
+		small = big = 0;
+		for (i = 0; i < BENCH_HUGE_BAND; i++) {
+			small += bench_huge_nsecs[i];
+			big += bench_huge_nsecs[BENCH_HUGE_STEPS - 1 - i];
+		}
+		printf("%-24s%8.1f us/grow at 1-%dMB %8.1f us/grow at %d-%dMB\n",
+				by_hand ? "malloc + memcpy + free" : "mm_realloc",
+				small / BENCH_HUGE_BAND / 1e3, BENCH_HUGE_BAND,
+				big / BENCH_HUGE_BAND / 1e3,
+				BENCH_HUGE_STEPS - BENCH_HUGE_BAND + 1, BENCH_HUGE_STEPS);
+	}
+}
+
+#define BENCH_MESH_OBJS (1<<16)  /* objects allocated before freeing */
+#define BENCH_MESH_KEEP 8        /* one in this many stays live */
+#define BENCH_MESH_SIZE 48
+
+/*
+ * bench_mesh - fragment a mesh cache by freeing most of its objects at
+ *     random, then mesh it and report the memory given back. Every
+ *     surviving object holds its own index, checked after meshing.
+ */
+static void bench_mesh(void)
+{
+	static long *objs[BENCH_MESH_OBJS];
+	mm_cache_t *c;
+	size_t before, after, saved;
+	double t;
+	int i, live = 0, bad = 0;
+
+	mem_reset_brk();
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_mesh");
+	if ((c = mm_cache_create_mesh(BENCH_MESH_SIZE, 0, NULL, NULL)) == NULL)
+		app_error("mm_cache_create_mesh failed in bench_mesh");
+
+	for (i = 0; i < BENCH_MESH_OBJS; i++) {
+		if ((objs[i] = mm_cache_alloc(c)) == NULL)
+			app_error("mm_cache_alloc failed in bench_mesh");
+		objs[i][0] = i;
+	}
+	srand(35);
+	for (i = 0; i < BENCH_MESH_OBJS; i++) {
+		if (rand() % BENCH_MESH_KEEP == 0) {
+			live++;
+			continue;
+		}
+		mm_cache_free(c, objs[i]);
+		objs[i] = NULL;
+	}
+
+	before = mem_arena_resident();
+	t = bench_nsecs();
+	saved = mm_cache_mesh(c);
+	t = bench_nsecs() - t;
+	after = mem_arena_resident();
+
+	for (i = 0; i < BENCH_MESH_OBJS; i++)
+		if (objs[i] != NULL && objs[i][0] != i)
+			bad++;
+	printf("%d of %d objects of %d bytes live, %d lost in meshing\n",
+			live, BENCH_MESH_OBJS, BENCH_MESH_SIZE, bad);
+	printf("%-24s%10lu KB\n", "resident before mesh", (unsigned long)before / 1024);
+	printf("%-24s%10lu KB (%lu KB meshed away in %.1f ms)\n",
+			"resident after mesh", (unsigned long)after / 1024,
+			(unsigned long)saved / 1024, t / 1e6);
+	for (i = 0; i < BENCH_MESH_OBJS; i++)
+		mm_cache_free(c, objs[i]);
+	mm_cache_destroy(c);
+}
+
+#define BENCH_PERSIST_KEYS    (1<<15)
+#define BENCH_PERSIST_BUCKETS (1<<12)
+
+/* A hash table node. Links are offsets from the table, which is the
+ * heap's root, so they hold wherever the heap file gets mapped. */
+typedef struct {
+	long next;
+	long key;
+	char val[48];
+} bench_node_t;
+
+/*
+ * bench_persist_build - fill a fresh heap with a hash table of
+ *     BENCH_PERSIST_KEYS nodes and make it the root
+ */
+static void bench_persist_build(void)
+{
+	long *table;
+	bench_node_t *node;
+	long i;
+
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_persist");
+	if ((table = mm_calloc(BENCH_PERSIST_BUCKETS, sizeof(long))) == NULL)
+		app_error("mm_calloc failed in bench_persist");
+	for (i = 0; i < BENCH_PERSIST_KEYS; i++) {
+		if ((node = mm_malloc(sizeof(bench_node_t))) == NULL)
+			app_error("mm_malloc failed in bench_persist");
+		node->key = i;
+		memset(node->val, (int)i, sizeof(node->val));
+		node->next = table[i % BENCH_PERSIST_BUCKETS];
+		table[i % BENCH_PERSIST_BUCKETS] = (char *)node - (char *)table;
+	}
+	mm_set_root(table);
+}
+
+/*
+ * bench_persist_check - how many keys can't be found in the root table
+ */
+static long bench_persist_check(void)
+{
+	long *table = mm_get_root();
+	bench_node_t *node;
+	long i, off, lost = 0;
+
+	for (i = 0; i < BENCH_PERSIST_KEYS; i++) {
+		node = NULL;
+		for (off = table[i % BENCH_PERSIST_BUCKETS]; off != 0; off = node->next) {
+			node = (bench_node_t *)((char *)table + off);
+			if (node->key == i)
+				break;
+		}
+		if (node == NULL || node->key != i || node->val[0] != (char)i)
+			lost++;
+	}
+	return lost;
+}
+
+/*
+ * bench_persist - build an index in a file heap, close it, then time
+ *     getting it back by reopening the file against building it again
+ */
+static void bench_persist(void)
+{
+	char path[] = "/tmp/mdriver-persist-XXXXXX";
+	double build, reopen;
+	size_t size;
+	long lost;
+	int fd;
+
+	if ((fd = mkstemp(path)) < 0)
+		unix_error("mkstemp failed in bench_persist");
+	close(fd);
+	mem_deinit();
+
+	if (mem_init_file(path) < 0)
+		unix_error("mem_init_file failed in bench_persist");
+	build = bench_nsecs();
+	bench_persist_build();
+	build = bench_nsecs() - build;
+	size = mem_heapsize();
+	mem_deinit();
+
+	reopen = bench_nsecs();
+	if (mem_init_file(path) < 0)
+		unix_error("mem_init_file failed in bench_persist");
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_persist");
+	reopen = bench_nsecs() - reopen;
+	lost = bench_persist_check();
+	mem_deinit();
+	unlink(path);
+	mem_init();
+
+	printf("%d keys in a %lu KB heap file, %ld lost on reopening\n",
+			BENCH_PERSIST_KEYS, (unsigned long)size / 1024, lost);
+	printf("%-24s%10.1f ms\n", "build", build / 1e6);
+	printf("%-24s%10.3f ms\n", "reopen", reopen / 1e6);
+}
+
+#define BENCH_SHARED_PROCS 4
+#define BENCH_SHARED_OBJS  (1<<12)  /* handed to the parent per process */
+#define BENCH_SHARED_CHURN 4        /* blocks malloced and freed per kept one */
+
+/*
+ * bench_shared_worker - allocate BENCH_SHARED_OBJS blocks in the shared
+ *     heap, each filled with its number, and publish them in the root
+ *     table as offsets from it. Churns other blocks on the way.
+ */
+static void bench_shared_worker(int proc)
+{
+	long *table = mm_get_root();
+	long *obj;
+	void *tmp[BENCH_SHARED_CHURN];
+	int i, j, k, size;
+
+	for (i = 0; i < BENCH_SHARED_OBJS; i++) {
+		k = proc * BENCH_SHARED_OBJS + i;
+		for (j = 0; j < BENCH_SHARED_CHURN; j++)
+			if ((tmp[j] = mm_malloc(16 + (k + j) % 200)) == NULL)
+				app_error("mm_malloc failed in bench_shared");
+		size = 16 + k % 500;
+		if ((obj = mm_malloc(size)) == NULL)
+			app_error("mm_malloc failed in bench_shared");
+		obj[0] = k;
+		obj[1] = size;
+		table[k] = (char *)obj - (char *)table;
+		for (j = 0; j < BENCH_SHARED_CHURN; j++)
+			mm_free(tmp[j]);
+	}
+}
+
+/*
+ * bench_shared_run - let procs forked processes fill the root table of
+ *     a new shared heap at once, then check and free their blocks from
+ *     this process. Returns the seconds the processes took.
+ */
+static double bench_shared_run(int procs, int *bad)
+{
+	long *table, *obj;
+	double t;
+	int i, status;
+
+	if (mem_init_shared(NULL) < 0)
+		unix_error("mem_init_shared failed in bench_shared");
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_shared");
+	if ((table = mm_calloc(procs * BENCH_SHARED_OBJS, sizeof(long))) == NULL)
+		app_error("mm_calloc failed in bench_shared");
+	mm_set_root(table);
+
+	t = bench_nsecs();
+	for (i = 0; i < procs; i++) {
+		pid_t pid = fork();
+
+		if (pid < 0)
+			unix_error("fork failed in bench_shared");
+		if (pid == 0) {
+			bench_shared_worker(i);
+			_exit(0);
+		}
+	}
+	for (i = 0; i < procs; i++)
+		if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			app_error("a worker failed in bench_shared");
+	t = bench_nsecs() - t;
+
+	for (i = 0; i < procs * BENCH_SHARED_OBJS; i++) {
+		obj = (long *)((char *)table + table[i]);
+		if (table[i] == 0 || obj[0] != i || obj[1] != 16 + i % 500)
+			(*bad)++;
+		else
+			mm_free(obj);
+	}
+	mm_free(table);
+	mm_checkheap(0);
+	mem_deinit();
+	return t / 1e9;
+}
+
+/*
+ * bench_shared - malloc and free from several processes in one shared
+ *     heap, against one process doing the same, and hand every kept
+ *     block back to the parent without copying
+ */
+static void bench_shared(void)
+{
+	double ops, secs;
+	int procs, handed = 0, bad = 0;
+
+	mem_deinit();
+	for (procs = 1; procs <= BENCH_SHARED_PROCS; procs *= 2) {
+		secs = bench_shared_run(procs, &bad);
+		ops = 2.0 * procs * BENCH_SHARED_OBJS * (BENCH_SHARED_CHURN + 1);
+		handed += procs * BENCH_SHARED_OBJS;
+		printf("%d process%s %8.0f Kops\n", procs, procs == 1 ? "  " : "es",
+				ops / 1e3 / secs);
+	}
+	printf("%d blocks handed over, %d bad\n", handed, bad);
+	mem_init();
+}
+
+#define BENCH_REGION_MAPS    4096
+#define BENCH_REGION_LOOKUPS (1<<20)
+#define BENCH_REGION_HEAP    "1M"      /* heap limit for the growth test */
+#define BENCH_REGION_BLOCK   (64<<10)
+#define BENCH_REGION_BLOCKS  1024
+
+/*
+ * bench_regions - time finding the mapping that holds a pointer among
+ *     BENCH_REGION_MAPS of them, with memlib's sorted registry against a
+ *     linear scan, then let the allocator run out of heap and carry on
+ *     in regions
+ */
+static void bench_regions(void)
+{
+	static char *maps[BENCH_REGION_MAPS];
+	static char *blocks[BENCH_REGION_BLOCKS];
+	size_t page = mem_pagesize();
+	double t, sorted, linear;
+	char *p;
+	long found = 0;
+	int i, j, in_heap = 0;
+
+	for (i = 0; i < BENCH_REGION_MAPS; i++)
+		if ((maps[i] = mem_map(page)) == (void *)-1)
+			app_error("mem_map failed in bench_regions");
+
+	srand(41);
+	t = bench_nsecs();
+	for (i = 0; i < BENCH_REGION_LOOKUPS; i++)
+		found += mem_map_find(maps[rand() % BENCH_REGION_MAPS] + 8, NULL) != NULL;
+	sorted = bench_nsecs() - t;
+	srand(41);
+	t = bench_nsecs();
+	for (i = 0; i < BENCH_REGION_LOOKUPS; i++) {
+		p = maps[rand() % BENCH_REGION_MAPS] + 8;
+		for (j = 0; j < BENCH_REGION_MAPS; j++)
+			if (p >= maps[j] && p < maps[j] + page) {
+				found++;
+				break;
+			}
+	}
+	linear = bench_nsecs() - t;
+	if (found != 2 * BENCH_REGION_LOOKUPS)
+		app_error("lost a mapping in bench_regions");
+	printf("%-24s%8.1f ns/lookup\n", "sorted registry", sorted / BENCH_REGION_LOOKUPS);
+	printf("%-24s%8.1f ns/lookup\n", "linear scan", linear / BENCH_REGION_LOOKUPS);
+
+	mem_deinit();
+	if (setenv("MM_MAX_HEAP", BENCH_REGION_HEAP, 1) < 0)
+		unix_error("setenv failed in bench_regions");
+	mem_init();
+	unsetenv("MM_MAX_HEAP");
+	if (mm_init() < 0)
+		app_error("mm_init failed in bench_regions");
+	for (i = 0; i < BENCH_REGION_BLOCKS; i++) {
+		if ((blocks[i] = mm_malloc(BENCH_REGION_BLOCK)) == NULL)
+			app_error("mm_malloc failed in bench_regions");
+		blocks[i][BENCH_REGION_BLOCK - 1] = 1;
+		in_heap += blocks[i] >= (char *)mem_heap_lo() &&
+			blocks[i] <= (char *)mem_heap_hi();
+	}
+	printf("%d blocks of %d KB with a %s heap: %d in the heap, %d in %lu KB of regions\n",
+			BENCH_REGION_BLOCKS, BENCH_REGION_BLOCK >> 10, BENCH_REGION_HEAP,
+			in_heap, BENCH_REGION_BLOCKS - in_heap,
+			(unsigned long)mem_mapsize() / 1024);
+	for (i = 0; i < BENCH_REGION_BLOCKS; i += 2)
+		mm_free(blocks[i]);
+	for (i = 1; i < BENCH_REGION_BLOCKS; i += 2)
+		mm_free(blocks[i]);
+	mm_checkheap(3);
+}
+
+#define BENCH_HEAPS_THREADS 4
+#define BENCH_HEAPS_OPS     (1<<20)  /* malloc/free pairs per thread */
+#define BENCH_HEAPS_LIVE    1024     /* blocks each thread keeps live */
+
+/*
+ * bench_heaps_worker - malloc and free BENCH_HEAPS_OPS blocks on the
+ *     thread's own heap, or on the current one if arg is NULL
+ */
+static void *bench_heaps_worker(void *arg)
+{
+	void *live[BENCH_HEAPS_LIVE] = {NULL};
+	unsigned seed = 44;
+	mem_heap_t *heap = NULL;
+	mm_heap_t *mm = NULL;
+	int i, k;
+
+	if (arg != NULL) {
+		if ((heap = mem_heap_create()) == NULL ||
+				(mm = mm_heap_create(heap)) == NULL)
+			app_error("mm_heap_create failed in bench_heaps");
+		mm_heap_use(mm);
+	}
+	for (i = 0; i < BENCH_HEAPS_OPS; i++) {
+		k = rand_r(&seed) % BENCH_HEAPS_LIVE;
+		mm_free(live[k]);
+		if ((live[k] = mm_malloc(16 + rand_r(&seed) % 500)) == NULL)
+			app_error("mm_malloc failed in bench_heaps");
+	}
+	for (k = 0; k < BENCH_HEAPS_LIVE; k++)
+		mm_free(live[k]);
+	mm_checkheap(0);
+	if (arg != NULL) {
+		mm_heap_destroy(mm);
+		mem_heap_destroy(heap);
+	}
+	return NULL;
+}
+
+/*
+ * bench_heaps - run the same churn in 1, 2 and 4 threads, each with a
+ *     heap and allocator of its own, against doing it all one after the
+ *     other on the default heap
+ */
+static void bench_heaps(void)
+{
+	pthread_t tids[BENCH_HEAPS_THREADS];
+	double t, serial, parallel;
+	int threads, i;
+
+	for (threads = 1; threads <= BENCH_HEAPS_THREADS; threads *= 2) {
+		if (mm_init() < 0)
+			app_error("mm_init failed in bench_heaps");
+		t = bench_nsecs();
+		for (i = 0; i < threads; i++)
+			bench_heaps_worker(NULL);
+		serial = bench_nsecs() - t;
+		mem_reset_brk();
+
+		t = bench_nsecs();
+		for (i = 0; i < threads; i++)
+			if (pthread_create(&tids[i], NULL, bench_heaps_worker, tids) != 0)
+				app_error("pthread_create failed in bench_heaps");
+		for (i = 0; i < threads; i++)
+			pthread_join(tids[i], NULL);
+		parallel = bench_nsecs() - t;
+
+		printf("%d thread%s  one heap %8.0f Kops  own heaps %8.0f Kops\n",
+				threads, threads == 1 ? " " : "s",
+				2.0 * threads * BENCH_HEAPS_OPS / 1e3 / (serial / 1e9),
+				2.0 * threads * BENCH_HEAPS_OPS / 1e3 / (parallel / 1e9));
+	}
+}
+
+/*************************************
+ * Some miscellaneous helper routines
  ************************************/
 
+/*
+ * in_region - is all of lo..hi inside the heap or inside one mapping
+ *     or region from memlib?
+ */
+static int in_region(const char *lo, const char *hi)
+{
+	size_t len;
+	char *region = mem_region_find(lo, &len, NULL);
+
+	return region != NULL && hi < region + len;
+}
+
 
 /*
- * printresults - prints a performance summary for some malloc package
+ * printresults - prints a performance summary for some malloc package,
+ *		with memlib's sbrk calls, KB grown, KB resident and page faults
+ *		when memlib is set
  */
-static void printresults(int n, stats_t *stats)
+static void printresults(int n, stats_t *stats, int memlib)
 {
 	int i;
 	/* weighted sums all */
 	double sumsecs = 0;
 	double sumops  = 0;
 	double sumutil = 0;
+	double sumstartup = 0;
 	int sum_perf_weight = 0;
 	int sum_util_weight = 0;
 
     char wstr;
 
 	/* Print the individual results for each trace */
-	printf("  %2s%6s %5s%8s%9s  %s\n",
-			"valid", "util", "ops", "secs", "Kops", "trace");
+	printf("  %2s%6s %5s%8s%9s%8s %6s%8s%8s%7s  %s\n",
+			"valid", "util", "ops", "secs", "Kops", "initus",
+			"sbrks", "sbrkKB", "resKB", "faults", "trace");
 	for (i=0; i < n; i++) {
 		if (stats[i].valid) {
             switch(stats[i].weight)
@@ -1285,6 +3167,19 @@ static void printresults(int n, stats_t *stats)
             else
                 printf("%8s%10s%6s", "--", "--", "--");
 
+            /* startup is only timed for mm */
+            if (memlib && stats[i].weight != WUTIL)
+                printf("%8.1f", stats[i].startup * 1e6);
+            else
+                printf("%8s", "--");
+
+            if (memlib)
+                printf(" %6zu%8zu%8zu%7ld", stats[i].mem.sbrk_calls,
+                        stats[i].mem.sbrk_bytes / 1024,
+                        stats[i].mem.resident / 1024, stats[i].mem.faults);
+            else
+                printf(" %6s%8s%8s%7s", "--", "--", "--", "--");
+
             printf(" %s\n", stats[i].filename);
 
             if(stats[i].weight == WALL || stats[i].weight == WPERF)
@@ -1292,6 +3187,7 @@ static void printresults(int n, stats_t *stats)
 			    sum_perf_weight += 1;
 			    sumsecs += stats[i].secs;
 			    sumops += stats[i].ops;
+			    sumstartup += stats[i].startup;
             }
             if(stats[i].weight == WALL || stats[i].weight == WUTIL)
             {
@@ -1300,13 +3196,18 @@ static void printresults(int n, stats_t *stats)
             }
 		}
 		else {
-			printf("%2s%4s %6s%8s%10s%6s %s\n",
+			printf("%2s%4s %6s%8s%10s%6s%8s %6s%8s%8s%7s %s\n",
 					stats[i].weight != 0 ? "*" : "",
 					"no",
 					"-",
 					"-",
 					"-",
 					"-",
+					"-",
+					"-",
+					"-",
+					"-",
+					"-",
 					stats[i].filename);
 		}
 	}
@@ -1316,13 +3217,16 @@ static void printresults(int n, stats_t *stats)
 		if(sum_perf_weight == 0) sum_perf_weight = 1;
 		if(sum_util_weight == 0) sum_util_weight = 1;
 
-		printf("%2d %2d  %5.0f%%%8.0f%10.6f%6.0f\n",
+		printf("%2d %2d  %5.0f%%%8.0f%10.6f%6.0f",
 				sum_util_weight,
                 sum_perf_weight,
 				(sumutil/(double)sum_util_weight)*100.0,
 				sumops,
 				sumsecs,
 				(sumsecs==0.0) ? 0 : (sumops/1e3)/sumsecs);
+		if (memlib)
+			printf("%8.1f", sumstartup * 1e6);
+		printf("\n");
 	}
 	else {
 		printf("     %8s%10s%6s\n",
@@ -1333,6 +3237,39 @@ static void printresults(int n, stats_t *stats)
 
 }
 
+/*
+ * printnet - print how long the harness took on each trace with the
+ *     null allocator (-C), and the times and Kops net of that
+ */
+static void printnet(int n, stats_t *stats)
+{
+	int i;
+	double net, sumsecs = 0, sumharness = 0, sumops = 0;
+
+	printf("  %8s%10s%10s%9s  %s\n", "ops", "raw", "harness", "netKops",
+			"trace");
+	for (i = 0; i < n; i++) {
+		if (!stats[i].valid)
+			continue;
+		net = stats[i].secs - stats[i].harness;
+		printf("  %8.0f%10.6f%10.6f", stats[i].ops, stats[i].secs,
+				stats[i].harness);
+		if (net > 0)
+			printf("%9.0f", stats[i].ops / 1e3 / net);
+		else
+			printf("%9s", "--");
+		printf("  %s\n", stats[i].filename);
+		if (stats[i].weight == WALL || stats[i].weight == WPERF) {
+			sumsecs += stats[i].secs;
+			sumharness += stats[i].harness;
+			sumops += stats[i].ops;
+		}
+	}
+	net = sumsecs - sumharness;
+	printf("  %8.0f%10.6f%10.6f%9.0f\n", sumops, sumsecs, sumharness,
+			net > 0 ? sumops / 1e3 / net : 0);
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1378,16 +3315,23 @@ void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
  */
 static void usage(void)
 {
-	fprintf(stderr, "Usage: mdriver [-hlVdD] [-f <file>]\n");
+	fprintf(stderr, "Usage: mdriver [-hlVdDP] [-f <file>] [-b <bench>]\n");
 	fprintf(stderr, "Options\n");
 	fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
 	fprintf(stderr, "\t-D         Equivalent to -d2.\n");
+	fprintf(stderr, "\t-H         Measure utilization through handles, compacting.\n");
 	fprintf(stderr, "\t-c <file>  Run trace file <file> once, check for correctness only.\n");
 	fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
 	fprintf(stderr, "\t-h         Print this message.\n");
 	fprintf(stderr, "\t-l         Run libc malloc as well.\n");
 	fprintf(stderr, "\t-V         Print diagnostics as each trace is run.\n");
 	fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
+	fprintf(stderr, "\t-m <size>  Let the heap grow to <size> bytes (K, M, G suffixes).\n");
+	fprintf(stderr, "\t-P         Time on a pre-faulted heap, without sbrk().\n");
+	fprintf(stderr, "\t-I         Leave mm_init's startup time out of the Kops.\n");
+	fprintf(stderr, "\t-C         Time the harness on a null allocator, report net times.\n");
 	fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
-	fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
+	fprintf(stderr, "\t-f <file>  Use <file> as the trace file (.rep, or .bin from rep2bin).\n");
+	fprintf(stderr, "\t-S <file>  Stream <file> through mm once, for traces too big to load.\n");
+	fprintf(stderr, "\t-b <name>  Run microbenchmark <name> (cache, sized, usable, batch,\n\t           calloc, zpool, copy, mremap,\n\t           mesh, persist, shared, regions,\n\t           heaps) instead of\n\t           traces.\n");
 }
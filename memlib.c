@@ -2,12 +2,19 @@
  * memlib.c - a module that simulates the memory system.	Needed because it 
  *						allows us to interleave calls from the student's malloc package 
  *						with the system's malloc package in libc.
+ *
+ * Each heap is a mem_heap_t, so several can be in use side by side. The
+ * mem_* functions without a handle work on a default heap set up by
+ * mem_init.
  */
+#define _GNU_SOURCE		/* for mremap, memfd_create and fallocate */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -16,79 +23,868 @@
 #include "memlib.h"
 #include "config.h"
 
-/* private variables */
-static char *heap;
-static char *mem_brk;
-static char *mem_max_addr;
+/* everything mapped outside the heap, by mem_map or mem_region_add,
+   sorted by address so mem_region_find can binary search it */
+typedef struct {
+	char *lo;
+	size_t len;
+	int kind;					/* MEM_MAP or MEM_REGION */
+} region_t;
 
-/* 
- * mem_init - initialize the memory system model
+struct mem_heap {
+	char *heap;
+	char *brk;
+	char *max_addr;
+	char *zero_brk;				/* highest brk since init, all zero above */
+	char *commit;				/* heap below here is usable, above reserved */
+	size_t max_heap;			/* bytes of address space kept for the heap */
+	int fd;						/* file behind the heap, -1 if anonymous */
+	int shared;					/* other processes may move the brk too */
+
+	region_t *regions;
+	int num_regions;
+	int max_regions;
+	size_t map_bytes;			/* total length of regions */
+	size_t peak;				/* highest heapsize + mapped since reset */
+
+	/* counters for mem_stats, cleared by mem_reset_brk */
+	size_t sbrk_calls;
+	size_t sbrk_bytes;
+	long faults_base;			/* minor faults so far at the last reset */
+
+	int options;				/* MEM_PREFAULT | MEM_NO_SBRK, 0 is realistic */
+};
+
+/* the heap of the mem_* functions that take no handle */
+static mem_heap_t mem_default = { .fd = -1 };
+
+/* the arena: ARENA_MAX bytes of a memfd mapped shared, virtual page i
+   shows file page i unless mem_arena_alias pointed it elsewhere. There
+   is one per process, it goes with the default heap. */
+#define ARENA_MAX (64*(1<<20))
+static int arena_fd = -1;
+static char *arena;
+static char *arena_brk;			/* pages below here have been handed out */
+static char **arena_free;		/* pages given back, reused first */
+static size_t num_arena_free;
+
+/* mem_sbrk commits reserved address space this much at a time */
+#define COMMIT_CHUNK (1<<20)
+
+static void mem_heap_init(mem_heap_t *h);
+static size_t mem_heap_limit(void);
+static int mem_commit_to(mem_heap_t *h, char *hi);
+static int mem_init_fd(mem_heap_t *h, int fd);
+static int mem_init_shm(mem_heap_t *h, const char *name);
+static void mem_sync_brk(mem_heap_t *h);
+static void mem_unmap_all(mem_heap_t *h);
+static void mem_update_peak(mem_heap_t *h);
+static void mem_stats_reset(mem_heap_t *h);
+static void mem_touch(char *lo, size_t len);
+static void mem_arena_deinit(void);
+
+/*
+ * mem_heap_init - set up h as an empty anonymous heap. Only reserves
+ *		the address space, mem_sbrk commits it as the heap grows.
  */
-void mem_init(void){
-	int dev_zero = open("/dev/zero", O_RDWR);
-	heap = mmap((void *)0x800000000, /* suggested start*/
-			MAX_HEAP,				/* length */
-			PROT_WRITE,				/* permissions */
-			MAP_PRIVATE,			/* private or shared? */
-			dev_zero,				/* fd */
+static void mem_heap_init(mem_heap_t *h){
+	memset(h, 0, sizeof(*h));
+	h->fd = -1;
+	h->max_heap = mem_heap_limit();
+	h->heap = mmap((void *)0x800000000, /* suggested start*/
+			h->max_heap,			/* length */
+			PROT_NONE,				/* permissions, none until committed */
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+			-1,						/* fd */
 			0);						/* offset (dunno) */
-	mem_max_addr = heap + MAX_HEAP;
-	mem_brk = heap;					/* heap is empty initially */
+	h->max_addr = h->heap + h->max_heap;
+	h->commit = h->heap;
+	h->brk = h->heap;				/* heap is empty initially */
+	h->zero_brk = h->heap;			/* anonymous pages start out zero */
+	mem_stats_reset(h);
+}
+
+/*
+ * mem_heap_create - a new anonymous heap of its own, for another
+ *		allocator to run on next to the default one. Returns NULL if
+ *		there is no room for it.
+ */
+mem_heap_t *mem_heap_create(void){
+	mem_heap_t *h = malloc(sizeof(mem_heap_t));
+
+	if (h == NULL)
+		return NULL;
+	mem_heap_init(h);
+	if (h->heap == MAP_FAILED) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+/*
+ * mem_heap_create_file - mem_heap_create with the heap kept in a file,
+ *		see mem_init_file. Returns NULL with errno set on failure.
+ */
+mem_heap_t *mem_heap_create_file(const char *path){
+	mem_heap_t *h;
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+
+	if (fd < 0)
+		return NULL;
+	if ((h = malloc(sizeof(mem_heap_t))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if (mem_init_fd(h, fd) < 0) {	/* it closed fd */
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+/*
+ * mem_heap_create_shared - mem_heap_create with the heap in shared
+ *		memory, see mem_init_shared. Returns NULL with errno set on
+ *		failure.
+ */
+mem_heap_t *mem_heap_create_shared(const char *name){
+	mem_heap_t *h = malloc(sizeof(mem_heap_t));
+
+	if (h == NULL || mem_init_shm(h, name) < 0) {
+		free(h);
+		return NULL;
+	}
+	return h;
+}
+
+/*
+ * mem_heap_destroy - give back everything h holds, and h itself
+ */
+void mem_heap_destroy(mem_heap_t *h){
+	mem_heap_deinit(h);
+	if (h != &mem_default)
+		free(h);
+}
+
+/*
+ * mem_heap_default - the heap mem_init sets up, for code that takes a
+ *		handle to work on it
+ */
+mem_heap_t *mem_heap_default(void){
+	return &mem_default;
+}
+
+/*
+ * mem_heap_limit - the most the heap can grow to: MM_MAX_HEAP from the
+ *		environment, in bytes with an optional K, M or G suffix, or else
+ *		MAX_HEAP. Rounded up to whole pages.
+ */
+static size_t mem_heap_limit(void){
+	const char *env = getenv("MM_MAX_HEAP");
+	size_t pagesize = mem_pagesize();
+	size_t max;
+	int shift = 0;
+	char *end;
+
+	if (env == NULL)
+		return MAX_HEAP;
+	errno = 0;
+	max = strtoull(env, &end, 0);
+	switch (*end) {
+		case 'G': case 'g':
+			shift += 10;
+			/* fall through */
+		case 'M': case 'm':
+			shift += 10;
+			/* fall through */
+		case 'K': case 'k':
+			shift += 10;
+			end++;
+	}
+	/* only digits and one suffix, and no more than fits once rounded */
+	if (errno != 0 || end == env || *end != '\0' || strchr(env, '-') ||
+			max > (SIZE_MAX - pagesize) >> shift)
+		max = 0;
+	max <<= shift;
+	if (max == 0) {
+		fprintf(stderr, "ERROR: bad MM_MAX_HEAP %s, using %zu\n",
+				env, (size_t)MAX_HEAP);
+		return MAX_HEAP;
+	}
+	return (max + pagesize - 1) & ~(pagesize - 1);
+}
+
+/*
+ * mem_commit_to - make the reserved heap usable up to at least hi
+ */
+static int mem_commit_to(mem_heap_t *h, char *hi){
+	char *to = h->heap + (((size_t)(hi - h->heap) + COMMIT_CHUNK - 1) &
+			~(size_t)(COMMIT_CHUNK - 1));
+
+	if (to > h->max_addr)
+		to = h->max_addr;
+	if (mprotect(h->commit, to - h->commit, PROT_READ | PROT_WRITE) != 0)
+		return -1;
+	if (h->options & MEM_PREFAULT)
+		mem_touch(h->commit, to - h->commit);
+	h->commit = to;
+	return 0;
+}
+
+/*
+ * mem_heap_set_options - how much of the real system cost the model
+ *		keeps. 0, the default, is realistic: pages fault in on first
+ *		touch and mem_sbrk calls sbrk() too (on the default heap only,
+ *		sbrk() isn't safe from several threads). MEM_PREFAULT touches
+ *		memory as it is committed, mapped or purged, so nothing faults
+ *		later on, and MEM_NO_SBRK leaves sbrk() out. Together they
+ *		leave timings with only the allocator's own work in them.
+ */
+void mem_heap_set_options(mem_heap_t *h, int options){
+	h->options = options;
+}
+
+/*
+ * mem_heap_prefault - commit the first len bytes of the heap and fault
+ *		them in now, so a timed run up to that size takes no page faults
+ */
+void mem_heap_prefault(mem_heap_t *h, size_t len){
+	char *hi = h->heap + (len < h->max_heap ? len : h->max_heap);
+
+	if (h->fd >= 0 && hi > h->brk)
+		hi = h->brk;			/* past the end of the file would SIGBUS */
+	if (hi > h->commit && mem_commit_to(h, hi) < 0)
+		return;
+	mem_touch(h->heap, hi - h->heap);
+}
+
+/*
+ * mem_touch - fault in the pages of [lo, lo+len) for writing, keeping
+ *		what they hold
+ */
+static void mem_touch(char *lo, size_t len){
+	size_t pagesize = mem_pagesize();
+	volatile char *p;
+
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(lo, len, MADV_POPULATE_WRITE) == 0)
+		return;
+#endif
+	for (p = lo; p < lo + len; p += pagesize)
+		*p = *p;
+}
+
+/*
+ * mem_init_shm - set up h in POSIX shared memory object name, or an
+ *		unnamed one if name is NULL, see mem_init_shared
+ */
+static int mem_init_shm(mem_heap_t *h, const char *name){
+	int fd;
+
+	if (name != NULL)
+		fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+	else
+		fd = memfd_create("mm-heap", 0);
+	if (fd < 0 || mem_init_fd(h, fd) < 0)
+		return -1;
+	h->shared = 1;
+	return 0;
 }
 
-/* 
- * mem_deinit - free the storage used by the memory system model
+/*
+ * mem_init_fd - set up h with the heap mapped shared from fd, which it
+ *		takes over
  */
-void mem_deinit(void){
-	munmap(heap, MAX_HEAP);
+static int mem_init_fd(mem_heap_t *h, int fd){
+	struct stat st;
+
+	memset(h, 0, sizeof(*h));
+	h->fd = -1;
+	h->max_heap = mem_heap_limit();
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		return -1;
+	}
+	if ((size_t)st.st_size > h->max_heap) {
+		close(fd);
+		errno = EFBIG;
+		return -1;
+	}
+	h->heap = mmap((void *)0x800000000, h->max_heap, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, fd, 0);
+	if (h->heap == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	h->fd = fd;
+	h->max_addr = h->heap + h->max_heap;
+	h->commit = h->max_addr;		/* the file backs all of it */
+	h->brk = h->heap + st.st_size;	/* the file is the heap */
+	h->zero_brk = h->brk;			/* the file grows with zeros */
+	mem_stats_reset(h);
+	return 0;
 }
 
 /*
- * mem_reset_brk - reset the simulated brk pointer to make an empty heap
+ * mem_heap_is_file - is the heap kept in a file (see mem_init_file)?
  */
-void mem_reset_brk(){
-	mem_brk = heap;
+int mem_heap_is_file(mem_heap_t *h){
+	return h->fd >= 0;
 }
 
-/* 
- * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *		by incr bytes and returns the start address of the new area. In
- *		this model, the heap cannot be shrunk.
+/*
+ * mem_heap_is_shared - was the heap made by mem_init_shared?
  */
-void *mem_sbrk(int incr) {
-	char *old_brk = mem_brk;
+int mem_heap_is_shared(mem_heap_t *h){
+	return h->shared;
+}
+
+/*
+ * mem_sync_brk - pick up the brk of a shared heap, which other
+ *		processes may have moved since we last looked
+ */
+static void mem_sync_brk(mem_heap_t *h){
+	struct stat st;
+
+	if (!h->shared || fstat(h->fd, &st) < 0)
+		return;
+	h->brk = h->heap + st.st_size;
+	if (h->brk > h->zero_brk)
+		h->zero_brk = h->brk;	/* written by others below, zero above */
+}
+
+/*
+ * mem_heap_deinit - free the storage used by heap h, but not h
+ */
+void mem_heap_deinit(mem_heap_t *h){
+	mem_unmap_all(h);
+	free(h->regions);
+	h->regions = NULL;
+	h->max_regions = 0;
+	if (h == &mem_default)
+		mem_arena_deinit();
+	munmap(h->heap, h->max_heap);
+	if (h->fd >= 0) {
+		close(h->fd);
+		h->fd = -1;
+		h->shared = 0;
+	}
+}
+
+/*
+ * mem_heap_reset_brk - reset the simulated brk pointer to make an empty
+ *		heap
+ */
+void mem_heap_reset_brk(mem_heap_t *h){
+	h->brk = h->heap;
+	if (h->fd >= 0 && ftruncate(h->fd, 0) < 0)
+		fprintf(stderr, "ERROR: mem_reset_brk failed to empty the heap file\n");
+	mem_unmap_all(h);
+	if (h == &mem_default)
+		mem_arena_deinit();
+	h->peak = 0;
+	mem_stats_reset(h);
+}
+
+/*
+ * mem_heap_sbrk - simple model of the sbrk function. Extends the heap
+ *		by incr bytes and returns the start address of the new area. A
+ *		negative incr shrinks the heap and gives the pages back.
+ */
+void *mem_heap_sbrk(mem_heap_t *h, intptr_t incr) {
+	char *old_brk;
+
+	mem_sync_brk(h);
+	old_brk = h->brk;
+	h->sbrk_calls++;
+
+	if (incr < 0) {
+		if (h->brk + incr < h->heap) {
+			errno = ENOMEM;
+			fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap...\n");
+			return (void *)-1;
+		}
+		h->brk += incr;
+		if (h->fd >= 0)
+			ftruncate(h->fd, h->brk - h->heap);
+		else
+			mem_heap_purge(h, h->brk, -incr);
+		return (void *)old_brk;
+	}
 
     // call sbrk() in an attempt to have similar semantics as a real allocator.
-	if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr) ||
-            sbrk(incr) == (void *) -1) {
+	// Only for the default heap: sbrk() isn't thread safe, and other
+	// heaps may grow from several threads at once.
+	if ( ((h->brk + incr) > h->max_addr) ||
+			(h->brk + incr > h->commit && mem_commit_to(h, h->brk + incr) < 0) ||
+            (h == &mem_default && !(h->options & MEM_NO_SBRK) &&
+			 sbrk(incr) == (void *) -1) ||
+			(h->fd >= 0 && ftruncate(h->fd, h->brk + incr - h->heap) < 0)) {
 		errno = ENOMEM;
 		fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 		return (void *)-1;
 	}
 
-	mem_brk += incr;
+	h->brk += incr;
+	h->sbrk_bytes += incr;
+	if (h->brk > h->zero_brk)
+		h->zero_brk = h->brk;
+	mem_update_peak(h);
 	return (void *)old_brk;
 }
 
 /*
- * mem_heap_lo - return address of the first heap byte
+ * mem_region_index - index of the last region of h starting at or
+ *		below p, -1 if there is none. Binary search of the sorted
+ *		registry.
+ */
+static int mem_region_index(mem_heap_t *h, const char *p) {
+	int lo = 0, hi = h->num_regions - 1, found = -1;
+
+	while (lo <= hi) {
+		int mid = (lo + hi) / 2;
+
+		if (h->regions[mid].lo <= p) {
+			found = mid;
+			lo = mid + 1;
+		} else
+			hi = mid - 1;
+	}
+	return found;
+}
+
+/*
+ * mem_region_insert - register len bytes at lo, keeping the registry
+ *		sorted. Returns 0, or -1 if the registry can't grow.
+ */
+static int mem_region_insert(mem_heap_t *h, char *lo, size_t len, int kind) {
+	int i;
+
+	if (h->num_regions == h->max_regions) {
+		int max = h->max_regions ? 2 * h->max_regions : 16;
+		region_t *grown = realloc(h->regions, max * sizeof(region_t));
+		if (grown == NULL)
+			return -1;
+		h->regions = grown;
+		h->max_regions = max;
+	}
+	i = mem_region_index(h, lo) + 1;
+	memmove(&h->regions[i + 1], &h->regions[i],
+			(h->num_regions - i) * sizeof(region_t));
+	h->regions[i].lo = lo;
+	h->regions[i].len = len;
+	h->regions[i].kind = kind;
+	h->num_regions++;
+	h->map_bytes += len;
+	return 0;
+}
+
+/*
+ * mem_region_delete - drop registry entry i, the caller unmaps it
+ */
+static void mem_region_delete(mem_heap_t *h, int i) {
+	h->map_bytes -= h->regions[i].len;
+	h->num_regions--;
+	memmove(&h->regions[i], &h->regions[i + 1],
+			(h->num_regions - i) * sizeof(region_t));
+}
+
+/*
+ * mem_region_at - index of the region of kind that starts at lo, or -1
+ */
+static int mem_region_at(mem_heap_t *h, const void *lo, int kind) {
+	int i = mem_region_index(h, lo);
+
+	if (i < 0 || h->regions[i].lo != lo || h->regions[i].kind != kind)
+		return -1;
+	return i;
+}
+
+/*
+ * mem_region_map - map len bytes (rounded up to whole pages) of zeroed
+ *		memory outside the heap and register it as kind. Returns the
+ *		start, or (void *)-1 if there is no memory left.
+ */
+static void *mem_region_map(mem_heap_t *h, size_t len, int kind) {
+	size_t pagesize = mem_pagesize();
+	char *lo;
+
+	len = (len + pagesize - 1) & ~(pagesize - 1);
+	lo = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+			(h->options & MEM_PREFAULT ? MAP_POPULATE : 0), -1, 0);
+	if (lo == MAP_FAILED || mem_region_insert(h, lo, len, kind) < 0) {
+		if (lo != MAP_FAILED)
+			munmap(lo, len);
+		errno = ENOMEM;
+		fprintf(stderr, "ERROR: mem_map failed. Ran out of memory...\n");
+		return (void *)-1;
+	}
+	mem_update_peak(h);
+	return (void *)lo;
+}
+
+/*
+ * mem_heap_map - map len bytes (rounded up to whole pages) of zeroed
+ *		memory outside the heap. Returns the start of the mapping, or
+ *		(void *)-1 if there is no memory left.
+ */
+void *mem_heap_map(mem_heap_t *h, size_t len) {
+	return mem_region_map(h, len, MEM_MAP);
+}
+
+/*
+ * mem_heap_remap - resize the mapping starting at lo to len bytes
+ *		(rounded up to whole pages). The kernel moves the pages if it has
+ *		to, so nothing is copied. Returns the new start, or (void *)-1
+ *		with the old mapping left alone.
+ */
+void *mem_heap_remap(mem_heap_t *h, void *lo, size_t len) {
+	size_t pagesize = mem_pagesize();
+	int i = mem_region_at(h, lo, MEM_MAP);
+	char *newlo;
+
+	if (i < 0) {
+		errno = EINVAL;
+		return (void *)-1;
+	}
+	len = (len + pagesize - 1) & ~(pagesize - 1);
+	newlo = mremap(h->regions[i].lo, h->regions[i].len, len, MREMAP_MAYMOVE);
+	if (newlo == MAP_FAILED) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+	if ((h->options & MEM_PREFAULT) && len > h->regions[i].len)
+		mem_touch(newlo + h->regions[i].len, len - h->regions[i].len);
+	/* it may have moved past its neighbours, so file it again, which
+	   can't fail as the delete leaves room */
+	mem_region_delete(h, i);
+	mem_region_insert(h, newlo, len, MEM_MAP);
+	mem_update_peak(h);
+	return (void *)newlo;
+}
+
+/*
+ * mem_heap_unmap - give back the mapping starting at lo. Returns 0, or
+ *		-1 if mem_map never handed out lo.
+ */
+int mem_heap_unmap(mem_heap_t *h, void *lo) {
+	int i = mem_region_at(h, lo, MEM_MAP);
+
+	if (i < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	munmap(h->regions[i].lo, h->regions[i].len);
+	mem_region_delete(h, i);
+	return 0;
+}
+
+/*
+ * mem_heap_map_find - return the start of the mapping that holds p and
+ *		set *len to its length, or return NULL if no mapping holds p.
+ */
+void *mem_heap_map_find(mem_heap_t *h, const void *p, size_t *len) {
+	int kind;
+	void *lo = mem_heap_region_find(h, p, len, &kind);
+
+	return kind == MEM_MAP ? lo : NULL;
+}
+
+/*
+ * mem_heap_region_add - map len bytes (rounded up to whole pages) of
+ *		zeroed memory anywhere in the address space, for an allocator to
+ *		carry on in when the heap can't grow. Returns the start, or
+ *		(void *)-1.
+ */
+void *mem_heap_region_add(mem_heap_t *h, size_t len) {
+	return mem_region_map(h, len, MEM_REGION);
+}
+
+/*
+ * mem_heap_region_remove - give back a region from mem_region_add.
+ *		Returns 0, or -1 if lo doesn't start one.
+ */
+int mem_heap_region_remove(mem_heap_t *h, void *lo) {
+	int i = mem_region_at(h, lo, MEM_REGION);
+
+	if (i < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	munmap(h->regions[i].lo, h->regions[i].len);
+	mem_region_delete(h, i);
+	return 0;
+}
+
+/*
+ * mem_heap_region_find - return the start of the memory that holds p,
+ *		be it the heap, a mapping from mem_map or a region from
+ *		mem_region_add, and set *len to its length and *kind to which
+ *		(either may be NULL). Returns NULL if p is in none of them.
+ */
+void *mem_heap_region_find(mem_heap_t *h, const void *p, size_t *len,
+		int *kind) {
+	const char *c = p;
+	int i;
+
+	if (c >= h->heap && c < h->brk) {
+		if (len != NULL)
+			*len = h->brk - h->heap;
+		if (kind != NULL)
+			*kind = MEM_HEAP;
+		return h->heap;
+	}
+	i = mem_region_index(h, c);
+	if (i < 0 || c >= h->regions[i].lo + h->regions[i].len) {
+		if (kind != NULL)
+			*kind = -1;
+		return NULL;
+	}
+	if (len != NULL)
+		*len = h->regions[i].len;
+	if (kind != NULL)
+		*kind = h->regions[i].kind;
+	return h->regions[i].lo;
+}
+
+/*
+ * mem_arena_init - set up the arena if it isn't already. Returns 0, or
+ *		-1 if the system has no memfd.
+ */
+int mem_arena_init(void) {
+	if (arena_fd >= 0)
+		return 0;
+	if ((arena_fd = memfd_create("mm-arena", 0)) < 0)
+		return -1;
+	if (ftruncate(arena_fd, ARENA_MAX) < 0 ||
+			(arena = mmap(NULL, ARENA_MAX, PROT_READ | PROT_WRITE,
+					MAP_SHARED, arena_fd, 0)) == MAP_FAILED ||
+			(arena_free = malloc(ARENA_MAX / mem_pagesize() *
+					sizeof(char *))) == NULL) {
+		if (arena != NULL && arena != MAP_FAILED)
+			munmap(arena, ARENA_MAX);
+		close(arena_fd);
+		arena_fd = -1;
+		arena = NULL;
+		return -1;
+	}
+	arena_brk = arena;
+	num_arena_free = 0;
+	return 0;
+}
+
+/*
+ * mem_arena_page - hand out a zeroed page of the arena that shows its
+ *		own file page. Returns (void *)-1 when the arena is full.
+ */
+void *mem_arena_page(void) {
+	char *page;
+
+	if (num_arena_free > 0)
+		return (void *)arena_free[--num_arena_free];
+	if (arena_fd < 0 || arena_brk + mem_pagesize() > arena + ARENA_MAX) {
+		errno = ENOMEM;
+		return (void *)-1;
+	}
+	page = arena_brk;
+	arena_brk += mem_pagesize();
+	return (void *)page;
+}
+
+/*
+ * mem_arena_alias - make page show the same memory as target, which has
+ *		to show its own file page. What page showed before is gone from
+ *		its point of view, but is not released. Returns 0 or -1.
+ */
+int mem_arena_alias(void *page, void *target) {
+	off_t off = (char *)target - arena;
+
+	if (mmap(page, mem_pagesize(), PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_FIXED, arena_fd, off) == MAP_FAILED)
+		return -1;
+	return 0;
+}
+
+/*
+ * mem_arena_release - give the memory behind page's own file page back
+ *		to the system. It reads as zero when next touched.
+ */
+void mem_arena_release(void *page) {
+	fallocate(arena_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(char *)page - arena, mem_pagesize());
+}
+
+/*
+ * mem_arena_free - point page back at its own file page, release that
+ *		and let mem_arena_page hand page out again.
+ */
+void mem_arena_free(void *page) {
+	mem_arena_alias(page, page);
+	mem_arena_release(page);
+	arena_free[num_arena_free++] = page;
+}
+
+/*
+ * mem_arena_resident - bytes of memory the arena really holds
+ */
+size_t mem_arena_resident(void) {
+	struct stat st;
+
+	if (arena_fd < 0 || fstat(arena_fd, &st) < 0)
+		return 0;
+	return (size_t)st.st_blocks * 512;
+}
+
+/* Tear the arena down, mem_arena_init starts a new one */
+static void mem_arena_deinit(void) {
+	if (arena_fd < 0)
+		return;
+	munmap(arena, ARENA_MAX);
+	close(arena_fd);
+	free(arena_free);
+	arena_fd = -1;
+	arena = NULL;
+	arena_free = NULL;
+}
+
+/* Unmap everything mem_map and mem_region_add handed out */
+static void mem_unmap_all(mem_heap_t *h) {
+	while (h->num_regions > 0) {
+		h->num_regions--;
+		munmap(h->regions[h->num_regions].lo, h->regions[h->num_regions].len);
+	}
+	h->map_bytes = 0;
+}
+
+/* Minor page faults the process has taken so far */
+static long mem_faults(void) {
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) != 0)
+		return 0;
+	return ru.ru_minflt;
+}
+
+/* Start the mem_stats counters over */
+static void mem_stats_reset(mem_heap_t *h) {
+	h->sbrk_calls = 0;
+	h->sbrk_bytes = 0;
+	h->faults_base = mem_faults();
+}
+
+/* Bytes of lo..lo+len (page aligned) that are in memory */
+static size_t mem_resident(char *lo, size_t len) {
+	size_t pagesize = mem_pagesize();
+	size_t pages = (len + pagesize - 1) / pagesize;
+	size_t i, in = 0;
+	unsigned char *vec;
+
+	if (pages == 0 || (vec = malloc(pages)) == NULL)
+		return 0;
+	if (mincore(lo, len, vec) == 0)
+		for (i = 0; i < pages; i++)
+			in += vec[i] & 1;
+	free(vec);
+	return in * pagesize;
+}
+
+/*
+ * mem_heap_stats - fill in what the heap has cost since the last
+ *		mem_reset_brk (or mem_init): mem_sbrk calls and bytes, pages of
+ *		the heap and of mappings and regions that are resident, and the
+ *		minor page faults the process took, on any heap.
  */
-void *mem_heap_lo(){
-	return (void *)heap;
+void mem_heap_stats(mem_heap_t *h, mem_stats_t *stats) {
+	int i;
+
+	stats->sbrk_calls = h->sbrk_calls;
+	stats->sbrk_bytes = h->sbrk_bytes;
+	stats->resident = mem_resident(h->heap, h->brk - h->heap);
+	for (i = 0; i < h->num_regions; i++)
+		stats->resident += mem_resident(h->regions[i].lo, h->regions[i].len);
+	stats->faults = mem_faults() - h->faults_base;
 }
 
-/* 
- * mem_heap_hi - return address of last heap byte
+/* Raise the high water mark of heap plus mappings */
+static void mem_update_peak(mem_heap_t *h) {
+	size_t total = mem_heap_size(h) + h->map_bytes;
+
+	if (total > h->peak)
+		h->peak = total;
+}
+
+/*
+ * mem_heap_zero_lo - return the lowest address mem_sbrk has never
+ *		handed out since the heap was set up. Everything from there up
+ *		reads as zero, even after mem_reset_brk.
+ */
+void *mem_heap_zero_lo(mem_heap_t *h){
+	return (void *)h->zero_brk;
+}
+
+/*
+ * mem_heap_purge - give the whole pages inside [lo, lo+len) back to the
+ *		system. They read as zero the next time they are touched.
+ *		Returns the number of bytes purged.
  */
-void *mem_heap_hi(){
-	return (void *)(mem_brk - 1);
+size_t mem_heap_purge(mem_heap_t *h, void *lo, size_t len){
+	size_t pagesize = mem_pagesize();
+	char *start = (char *)(((size_t)lo + pagesize - 1) & ~(pagesize - 1));
+	char *end = (char *)(((size_t)lo + len) & ~(pagesize - 1));
+
+	if (end <= start)
+		return 0;
+	if (h->fd >= 0) {
+		/* dropping the pages of a shared mapping keeps the file data */
+		if (fallocate(h->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					start - h->heap, end - start) != 0)
+			return 0;
+	} else if (madvise(start, end - start, MADV_DONTNEED) != 0)
+		return 0;
+	if (h->options & MEM_PREFAULT)
+		mem_touch(start, end - start);	/* fresh zero pages, no fault later */
+	return end - start;
+}
+
+/*
+ * mem_heap_low - return address of the first heap byte
+ */
+void *mem_heap_low(mem_heap_t *h){
+	return (void *)h->heap;
 }
 
 /*
- * mem_heapsize() - returns the heap size in bytes
+ * mem_heap_high - return address of last heap byte
  */
-size_t mem_heapsize() {
-	return (size_t)((void *)mem_brk - (void *)heap);
+void *mem_heap_high(mem_heap_t *h){
+	mem_sync_brk(h);
+	return (void *)(h->brk - 1);
+}
+
+/*
+ * mem_heap_size - returns the heap size in bytes
+ */
+size_t mem_heap_size(mem_heap_t *h) {
+	mem_sync_brk(h);
+	return (size_t)((void *)h->brk - (void *)h->heap);
+}
+
+/*
+ * mem_heap_mapsize - returns the bytes mapped by mem_map and
+ *		mem_region_add right now
+ */
+size_t mem_heap_mapsize(mem_heap_t *h) {
+	return h->map_bytes;
+}
+
+/*
+ * mem_heap_peaksize - returns the most memory the heap and the mappings
+ *		have held together since the last mem_reset_brk
+ */
+size_t mem_heap_peaksize(mem_heap_t *h) {
+	return h->peak;
 }
 
 /*
@@ -97,3 +893,77 @@ size_t mem_heapsize() {
 size_t mem_pagesize(){
 	return (size_t)getpagesize();
 }
+
+/***** The default heap: *****/
+
+/*
+ * mem_init - initialize the memory system model. Only reserves the
+ *		address space for the heap, mem_sbrk commits it as the heap grows.
+ */
+void mem_init(void){
+	mem_heap_init(&mem_default);
+}
+
+/*
+ * mem_init_file - mem_init with the heap kept in the file at path,
+ *		mapped shared so everything written to the heap lands in the file.
+ *		The file is created if it doesn't exist, otherwise the heap is
+ *		whatever the file holds. Returns 0, or -1 with errno set.
+ */
+int mem_init_file(const char *path){
+	int fd = open(path, O_RDWR | O_CREAT, 0600);
+
+	if (fd < 0)
+		return -1;
+	return mem_init_fd(&mem_default, fd);
+}
+
+/*
+ * mem_init_shared - mem_init with the heap in POSIX shared memory
+ *		object name, created if it doesn't exist, for several processes
+ *		to use at once. A NULL name makes an unnamed heap that only
+ *		children forked after this call share. The brk lives in the size
+ *		of the object, so the caller has to serialize mem_sbrk calls
+ *		across processes. Returns 0, or -1 with errno set.
+ */
+int mem_init_shared(const char *name){
+	return mem_init_shm(&mem_default, name);
+}
+
+/* The rest do what mem_heap_ of the same name does, on the default heap */
+void mem_deinit(void){ mem_heap_deinit(&mem_default); }
+void mem_reset_brk(void){ mem_heap_reset_brk(&mem_default); }
+int mem_is_file(void){ return mem_heap_is_file(&mem_default); }
+int mem_is_shared(void){ return mem_heap_is_shared(&mem_default); }
+void *mem_sbrk(intptr_t incr){ return mem_heap_sbrk(&mem_default, incr); }
+void *mem_heap_lo(void){ return mem_heap_low(&mem_default); }
+void *mem_heap_hi(void){ return mem_heap_high(&mem_default); }
+size_t mem_heapsize(void){ return mem_heap_size(&mem_default); }
+void *mem_zero_lo(void){ return mem_heap_zero_lo(&mem_default); }
+size_t mem_purge(void *lo, size_t len){
+	return mem_heap_purge(&mem_default, lo, len);
+}
+void *mem_map(size_t len){ return mem_heap_map(&mem_default, len); }
+void *mem_remap(void *lo, size_t len){
+	return mem_heap_remap(&mem_default, lo, len);
+}
+int mem_unmap(void *lo){ return mem_heap_unmap(&mem_default, lo); }
+void *mem_map_find(const void *p, size_t *len){
+	return mem_heap_map_find(&mem_default, p, len);
+}
+size_t mem_mapsize(void){ return mem_heap_mapsize(&mem_default); }
+size_t mem_peaksize(void){ return mem_heap_peaksize(&mem_default); }
+void *mem_region_add(size_t len){
+	return mem_heap_region_add(&mem_default, len);
+}
+int mem_region_remove(void *lo){
+	return mem_heap_region_remove(&mem_default, lo);
+}
+void *mem_region_find(const void *p, size_t *len, int *kind){
+	return mem_heap_region_find(&mem_default, p, len, kind);
+}
+void mem_stats(mem_stats_t *stats){ mem_heap_stats(&mem_default, stats); }
+void mem_set_options(int options){
+	mem_heap_set_options(&mem_default, options);
+}
+void mem_prefault(size_t len){ mem_heap_prefault(&mem_default, len); }
@@ -1,11 +1,91 @@
+#include <stdint.h>
 #include <unistd.h>
 
 void mem_init(void);               
+int mem_init_file(const char *path);
+int mem_init_shared(const char *name);
+int mem_is_file(void);
+int mem_is_shared(void);
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
+void *mem_zero_lo(void);
+size_t mem_purge(void *lo, size_t len);
+
+void *mem_map(size_t len);
+void *mem_remap(void *lo, size_t len);
+int mem_unmap(void *lo);
+void *mem_map_find(const void *p, size_t *len);
+size_t mem_mapsize(void);
+size_t mem_peaksize(void);
+
+/* what mem_region_find found p in */
+enum { MEM_HEAP, MEM_MAP, MEM_REGION };
+void *mem_region_add(size_t len);
+int mem_region_remove(void *lo);
+void *mem_region_find(const void *p, size_t *len, int *kind);
+
+/* what the heap cost since the last mem_reset_brk, from mem_stats */
+typedef struct {
+	size_t sbrk_calls;		/* calls to mem_sbrk */
+	size_t sbrk_bytes;		/* bytes they grew the heap by */
+	size_t resident;		/* bytes of heap and regions in memory now */
+	long faults;			/* minor page faults taken by the process */
+} mem_stats_t;
+void mem_stats(mem_stats_t *stats);
+
+/* how real the memory model is, see mem_set_options */
+enum { MEM_PREFAULT = 1, MEM_NO_SBRK = 2 };
+void mem_set_options(int options);
+void mem_prefault(size_t len);
+
+/* Heaps of their own: the same calls as above on heap h, which the
+   ones above do on the heap mem_init sets up */
+typedef struct mem_heap mem_heap_t;
+mem_heap_t *mem_heap_create(void);
+mem_heap_t *mem_heap_create_file(const char *path);
+mem_heap_t *mem_heap_create_shared(const char *name);
+void mem_heap_destroy(mem_heap_t *h);
+void mem_heap_deinit(mem_heap_t *h);
+mem_heap_t *mem_heap_default(void);
+int mem_heap_is_file(mem_heap_t *h);
+int mem_heap_is_shared(mem_heap_t *h);
+void *mem_heap_sbrk(mem_heap_t *h, intptr_t incr);
+void mem_heap_reset_brk(mem_heap_t *h);
+void *mem_heap_low(mem_heap_t *h);
+void *mem_heap_high(mem_heap_t *h);
+size_t mem_heap_size(mem_heap_t *h);
+void *mem_heap_zero_lo(mem_heap_t *h);
+size_t mem_heap_purge(mem_heap_t *h, void *lo, size_t len);
+void *mem_heap_map(mem_heap_t *h, size_t len);
+void *mem_heap_remap(mem_heap_t *h, void *lo, size_t len);
+int mem_heap_unmap(mem_heap_t *h, void *lo);
+void *mem_heap_map_find(mem_heap_t *h, const void *p, size_t *len);
+size_t mem_heap_mapsize(mem_heap_t *h);
+size_t mem_heap_peaksize(mem_heap_t *h);
+void *mem_heap_region_add(mem_heap_t *h, size_t len);
+int mem_heap_region_remove(mem_heap_t *h, void *lo);
+void *mem_heap_region_find(mem_heap_t *h, const void *p, size_t *len,
+		int *kind);
+void mem_heap_stats(mem_heap_t *h, mem_stats_t *stats);
+void mem_heap_set_options(mem_heap_t *h, int options);
+void mem_heap_prefault(mem_heap_t *h, size_t len);
+
+/* The arena, one per process: pages of a memfd, each showing its own
+   file page until mem_arena_alias points it at another page's, so two
+   pages can share memory. mem_arena_init sets it up (0, or -1 with no
+   memfd), mem_arena_page hands out a zeroed page ((void *)-1 when
+   full), mem_arena_release gives the memory behind a page back,
+   mem_arena_free gives the page itself back for reuse, and
+   mem_arena_resident is the bytes the arena really holds */
+int mem_arena_init(void);
+void *mem_arena_page(void);
+int mem_arena_alias(void *page, void *target);
+void mem_arena_release(void *page);
+void mem_arena_free(void *page);
+size_t mem_arena_resident(void);
 
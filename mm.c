@@ -15,16 +15,65 @@
  * When malloc splits a free block it returns the latter portion
  * of the block as allocated space so it doesn't have to move around
  * pointers in the front. 
+ *
+ * Object caches (mm_cache_*) sit on top of malloc: a cache carves
+ * slabs obtained from malloc into fixed size slots and keeps freed
+ * objects constructed on a per-slab free list. Empty slabs are only
+ * handed back to malloc by mm_cache_reap, which malloc calls itself
+ * when the heap can't grow any more. Caches made in mesh mode keep
+ * their slabs in a memfd arena and can merge partly used ones. 
+ *
+ * Blocks of MAP_MIN bytes or more get a mapping of their own instead
+ * of heap space, realloc resizes those with mem_remap so the kernel
+ * moves pages rather than malloc copying bytes. 
+ *
+ * Once mem_sbrk can't grow the heap any further, new space comes from
+ * regions (mem_region_add) mapped wherever the system likes. Each is
+ * laid out like a small heap of its own and its free blocks share the
+ * free list. 
+ *
+ * The heap starts with a root record and the free list, handle table
+ * and mm_set_root pointer are kept as offsets from it, so a file heap
+ * (mem_init_file) can be mapped again by a later process and mm_init
+ * carries on from it. Caches, the zero pool, the compactor's place
+ * and big block mappings belong to the process and are not kept: a
+ * file heap serves big blocks from the heap, keeps cache slabs in
+ * mappings of their own and has no zero pool, so nothing of theirs is
+ * left behind in the heap when the process stops. A heap shared between
+ * processes (mem_init_shared) works the same way with a lock in the
+ * root held by every call. 
+ *
+ * mm_halloc hands out blocks behind handles instead of pointers. While
+ * not locked they can be moved by mm_hcompact, which slides them down
+ * over free space a bounded amount at a time and trims the free tail. 
+ *
+ * calloc skips zeroing blocks flagged ZERO (fresh or purged memory). 
+ * With mm_zpool_enable it also draws on a pool of blocks that free
+ * zeroes ahead of time. 
+ *
+ * realloc and calloc move memory with mm_copy and mm_zero, which pick
+ * a kernel by size and CPU. 
  */
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+
 #include "mm.h"
 #include "memlib.h"
 
+/* If you want free_sized to check the caller's size against the
+ * block header, define SIZED_CHECK. */
+/* #define SIZED_CHECK */
+
 /* If you want debugging output, use the following macro.  When you hand
  * in, remove the #define DEBUG line. */
 #define DEBUG
@@ -44,6 +93,17 @@
 #define calloc mm_calloc
 #endif /* def DRIVER */
 
+#ifdef DRIVER
+#define memalign mm_memalign
+#define posix_memalign mm_posix_memalign
+#define aligned_alloc mm_aligned_alloc
+#define free_sized mm_free_sized
+#define malloc_usable_size mm_malloc_usable_size
+#define malloc_good_size mm_good_size
+#define malloc_batch mm_malloc_batch
+#define free_batch mm_free_batch
+#endif /* def DRIVER */
+
 /* single word (4) or double word (8) alignment */
 #define ALIGNMENT 8
 
@@ -57,13 +117,57 @@ void set1Ptr(void *block, void *ptr, int firstOrSecond);
 void setPtr1Way(void *block, void *ptr, int firstOrSecond);
 void setPtrs(void *block, void *ptr1, void *ptr2);
 void *getPtr(void *block, int firstOrSecond); 
+void freeBlock(void *ptr);
+void *mapBlock(long size);
+void *remapBlock(void *ptr, long size);
+void unmapBlock(void *ptr);
+static void *addRegion(long sizeToAlloc);
+void compactFix(void *block);
+void kernelInit(void);
+static pthread_once_t kernelOnce=PTHREAD_ONCE_INIT;
+int zpoolKeep(void *ptr);
+void zpoolRefill(void);
+void *zpoolTake(size_t bytes);
+size_t zpoolDrain(void);
+size_t reclaim(void);
 static int in_heap(const void *p);
+static int heapLock(void);
+static void heapUnlock(int *held);
+
+/* Start of every entry point that touches the heap: holds the heap
+ * lock, if it is shared, until the function returns. 
+ */
+#define HEAP_LOCKED \
+  int heapHeld __attribute__((cleanup(heapUnlock)))=heapLock()
 static int aligned(const void *p);
 
 #define START_SIZE (1<<9)
-void *start=NULL;//Points to the start of our memory
-unsigned totalSize=0;//amount of memory in bytes
-void *first;
+#define ROOT_LAYOUT 2L//bump whenever root_t changes
+#define ROOT_MAGIC (0x6d6d68656170L | ROOT_LAYOUT<<48)//"mmheap", layout
+
+/* Everything needed to pick the heap up again, kept at the very start
+ * of a file or shared heap. A heap of the process's own is never
+ * picked up again, so its root is kept outside it, in its mm_heap_t,
+ * and takes no heap space. Pointers are offsets from the root, 0 for
+ * NULL, so the heap can be mapped anywhere. 
+ */
+typedef struct {
+  long magic;
+  long size;//bytes of heap after the root
+  long first;//first free block
+  long hslots;//handle table
+  long numHslots;
+  long freeHslot;
+  long user;//mm_set_root's object
+  pthread_mutex_t lock;//taken by every call on a shared heap
+} root_t;
+#define ROOT_SIZE ((long)sizeof(root_t))
+
+#define totalSize (mm->root->size)//amount of memory in bytes
+#define toOff(p) ((p)==NULL?0:(long)((char *)(p)-(char *)mm->root))
+#define fromOff(o) ((o)==0?NULL:(void *)((char *)mm->root+(o)))
+#define getFirst() fromOff(mm->root->first)
+#define setFirst(p) (mm->root->first=toOff(p))
 
 /* given a pointer, returns the last bit of the byte it points to
  * used to store if a block is allocated or not
@@ -71,7 +175,57 @@ void *first;
 #define gl(p) (*((long *)(p)))//return the long stored at p where p=void*
 #define gp(p) (*((void **)(p)))//return the pointer (void *) stored at p
 #define is_alloc(p) ((gl(p)) & 0x01)
-#define block_size(p) ((gl(p))>>1)//if p is a header returns size of data
+#define block_size(p) (((gl(p))>>1) & ~0x7)//if p is a header returns size of data
+
+/* Sizes are multiples of 8 so bits 1-3 of a header are free for flags. 
+ * ZERO on a free block: its data is all zero past the two list pointers
+ */
+#define ZERO 0x2
+#define is_zero(p) ((gl(p)) & ZERO)
+#define PURGE_MIN (1<<20)//free blocks this big get purged to zero
+#define MAPPED 0x4//block has a mapping of its own, no footer
+#define is_mapped(p) ((gl(p)) & MAPPED)
+#define MAP_MIN (1<<20)//blocks this big are mapped
+#define REGION_MIN (1<<22)//least a region adds when the heap is full
+#define BLOCK_MAX ((size_t)1<<48)//bigger requests fail, sizes can't overflow
+#define HANDLE 0x8//allocated block behind a handle, may be moved
+#define is_handle(p) ((gl(p)) & HANDLE)
+
+/* Pre-zeroed pool for calloc, see the pool's section below */
+#define ZPOOL_CLASSES 6
+#define ZPOOL_MIN (1<<12)//class k holds [ZPOOL_MIN<<k, ZPOOL_MIN<<(k+1))
+#define ZPOOL_MAX ((ZPOOL_MIN<<ZPOOL_CLASSES)-1)
+#define ZPOOL_DEPTH 16//most blocks kept per class, dirty or clean
+#define zpoolClass(s) ((int)(63-__builtin_clzl((s)/ZPOOL_MIN)))
+
+/* Everything an allocator keeps outside its heap. mm_heap_create makes
+ * more of them, the names below stand for the fields of the one the
+ * calling thread uses (see mm_heap_use). 
+ */
+struct mm_heap {
+  mem_heap_t *mem;//the memlib heap it runs on, NULL for the default
+  root_t *root;
+  void *start;//Points to the start of our memory
+  int shared;//other processes use the heap too
+  int mapBig;//process local mappings will do: big blocks and regions
+  void *regions;//regions the heap went on in, linked through their first word
+  int heapFull;//mem_sbrk failed, go straight to a region
+  mm_cache_t *caches;//every live object cache, for reaping
+  int lastZero;//was the last block malloc_here gave out ZERO
+
+  int zpoolOn;
+  void *zpoolDirty;//blocks waiting to be zeroed
+  void *zpoolClean[ZPOOL_CLASSES];
+  int zpoolCount[ZPOOL_CLASSES];//dirty and clean blocks per class
+
+  /* Handles, see their section below, hslots is a copy of root->hslots */
+  long *hslots;
+  void *compactAt;//block the compactor looks at next
+
+  root_t ownRoot;//the root, if the heap is not a file or shared heap
+};
+static mm_heap_t mmDefault;
+static __thread mm_heap_t *mm=&mmDefault;
 
 /* Set the header at p to have size of s and alloc b
  */
@@ -89,49 +243,164 @@ void setAlloc(void *p, long b){
 void setBlock(void *p, long s){
   setHeader(p, s, is_alloc(p));
 }
+/* Mark the free block at p as ZERO, header and footer
+ */
+void setZero(void *p){
+  gl(p)|=ZERO;
+  gl(p+block_size(p)+8)|=ZERO;
+}
 
 
 /*
- * Initialize: return -1 on error, 0 on success.
+ * Initialize: return -1 on error, 0 on success. If the heap already
+ * holds a root (a file heap being reopened) the allocator carries on
+ * from it as it was. 
  */
 int mm_init(void) {
-  start=mem_sbrk(START_SIZE);
+  if(mm->mem==NULL)
+    mm->mem=mem_heap_default();
+  void *fresh=mem_heap_zero_lo(mm->mem);
 
-  if(!start)
-    return -1;
+  pthread_once(&kernelOnce, kernelInit);//once per process, not per heap
+  mm->caches=NULL;//old caches and pooled blocks lived in the old heap
+  mm->zpoolDirty=NULL;
+  memset(mm->zpoolClean, 0, sizeof(mm->zpoolClean));
+  memset(mm->zpoolCount, 0, sizeof(mm->zpoolCount));
+  mm->compactAt=NULL;
+  mm->mapBig=!mem_heap_is_file(mm->mem);//mappings would not outlive the process
+  mm->zpoolOn&=mm->mapBig;//see mm_zpool_enable
+  mm->shared=mem_heap_is_shared(mm->mem);
+  mm->regions=NULL;//unmapped by mem_reset_brk with the mappings
+  mm->heapFull=0;
+  if(mm->mapBig){//the heap is the process's own, its root is not kept in it
+    mm->root=&mm->ownRoot;
+    if(mm->root->magic==ROOT_MAGIC && mm->start==mem_heap_low(mm->mem) &&
+       mem_heap_size(mm->mem)>0)
+      return 0;//not reset since the last mm_init, carry on
+    if((mm->start=mem_heap_sbrk(mm->mem, START_SIZE))==(void *)-1)
+      return -1;
+  }
+  else{
+    mm->root=mem_heap_low(mm->mem);
+    if(mem_heap_size(mm->mem)>ROOT_SIZE && mm->root->magic==ROOT_MAGIC){
+      mm->start=(char *)mm->root+ROOT_SIZE;
+      mm->hslots=fromOff(mm->root->hslots);
+      /* drop what a process that stopped while growing the heap added */
+      long torn=mem_heap_size(mm->mem)-ROOT_SIZE-totalSize;
+      if(!mm->shared && torn>0)
+        mem_heap_sbrk(mm->mem, -torn);
+      return 0;
+    }
+    mm->root=mem_heap_sbrk(mm->mem, ROOT_SIZE+START_SIZE);
+    if(mm->root==(void *)-1)
+      return -1;
+    mm->start=(char *)mm->root+ROOT_SIZE;
+  }
+  memset(mm->root, 0, ROOT_SIZE);
   totalSize=START_SIZE;
+  mm->hslots=NULL;
+  mm->root->freeHslot=-1;
+  if(mm->shared){
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);//entry points call each other
+    pthread_mutex_init(&mm->root->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
   //initialize begining block
-  void *temp=createBlock(start, 0, 1);
+  void *temp=createBlock(mm->start, 0, 1);
 
   //initialize middle block
-  first=temp;
+  setFirst(temp);
   setPtrs(temp, NULL, NULL);
   temp=createBlock(temp, (START_SIZE-(6*8)), 0);
 
   //initialize ending block
   createBlock(temp, 0, 1);
+  if(mm->start>=fresh)
+    setZero(getFirst());
+  mm->root->magic=ROOT_MAGIC;//last, a torn init is not a heap
   return 0;
 }
 
+/*
+ * mm_set_root - remember ptr, a block of this heap or NULL, as the
+ * way back into the caller's data after the heap is reopened
+ */
+void mm_set_root(void *ptr){
+  mm->root->user=toOff(ptr);
+}
+
+/*
+ * mm_get_root - the pointer last given to mm_set_root
+ */
+void *mm_get_root(void){
+  return fromOff(mm->root->user);
+}
+
+/*
+ * mm_heap_create - an allocator of its own on heap, set up as mm_init
+ * would. It lives outside every heap, so mem_reset_brk and mm_init
+ * on heap leave it be. Returns NULL on failure. 
+ */
+mm_heap_t *mm_heap_create(mem_heap_t *heap){
+  mm_heap_t *h=mmap(NULL, sizeof(mm_heap_t), PROT_READ|PROT_WRITE,
+                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);//zeroed
+  if(h==MAP_FAILED)
+    return NULL;
+  h->mem=heap;
+  mm_heap_t *was=mm_heap_use(h);
+  int ok=mm_init();
+  mm_heap_use(was);
+  if(ok<0){
+    munmap(h, sizeof(mm_heap_t));
+    return NULL;
+  }
+  return h;
+}
+
+/*
+ * mm_heap_use - make the calling thread's calls work on h, or on the
+ * default allocator if h is NULL. Returns the one they worked on. 
+ */
+mm_heap_t *mm_heap_use(mm_heap_t *h){
+  mm_heap_t *was=mm;
+  mm=(h==NULL ? &mmDefault : h);
+  return was;
+}
+
+/*
+ * mm_heap_destroy - forget h, its memlib heap is the caller's to
+ * destroy. A thread still using it goes back to the default. 
+ */
+void mm_heap_destroy(mm_heap_t *h){
+  if(mm==h)
+    mm=&mmDefault;
+  munmap(h, sizeof(mm_heap_t));
+}
+
 /* Declare the area in start to be a block, assumed all will fit.
  * Size is data size, will add 2 for total size of block. 
  * Returns a pointer to the next word after the end of this 
  * block for convenience. 
  */
-void *createBlock(void *here, long size, long alloc){
-  setHeader(here, size, alloc);
-  here+=(size+8);
-  setHeader(here, size, alloc);
-  return (here+8);
+void *createBlock(void *start, long size, long alloc){
+  setHeader(start, size, alloc);
+  start+=(size+8);
+  setHeader(start, size, alloc);
+  return (start+8);
 }
 
-/* sets the first or second pointer of block to ptr,
+/* sets the first or second pointer of block to ptr, as an offset,
  * DOES NOT set ptr's pointer the other way (for one way pointers)
  */
 void setPtr1Way(void *block, void *ptr, int firstOrSecond){
-  void **newPtr=block;
+  long *newPtr=block;
   newPtr+=firstOrSecond;
-  *newPtr=ptr;
+  *newPtr=toOff(ptr);
 }
 /* Set the pointer in a free block for the explicit list. 
  * firstOrSecond: give 1 to set the first pointer..., 
@@ -154,27 +423,112 @@ void setPtrs(void *block, void *ptr1, void *ptr2){
   set1Ptr(block, ptr2, 2);
 }
 /* returns either the first or second pointer at block
- * based on firstOrSecond
+ * based on firstOrSecond, they are stored as offsets from the root
  */
 void *getPtr(void *block, int firstOrSecond){
-  return gp(block+(firstOrSecond*8));
+  return fromOff(gl(block+(firstOrSecond*8)));
 }
 
 /* returns min of a and b
  */
-unsigned min(long a, long b){
+long min(long a, long b){
   if(a<b)
     return a;
   return b;
 }
 /* returns the max of a and b
  */
-unsigned max(long a, long b){
+long max(long a, long b){
   if(a>b)
     return a;
   return b;
 }
 
+/* Take a free block out of the explicit list
+ */
+void unlinkFree(void *block){
+  void *prev=getPtr(block, 1);
+  void *next=getPtr(block, 2);
+
+  if(getFirst()==block){//invariant that prev=null
+    if(next!=NULL)
+      set1Ptr(next, NULL, 1);
+    setFirst(next);
+  }
+  else
+    set1Ptr(prev, next, 2);//set prev's next pointer
+}
+
+/* Grow the heap by sizeToAlloc bytes. The new space is added to the
+ * last block if that one is free, otherwise it becomes a free block
+ * at the front of the free list. If the heap can't grow the space
+ * comes from a new region instead. Returns the free block holding the
+ * new space or NULL if there is no memory left. 
+ */
+void *extendHeap(long sizeToAlloc){
+  mm_heap_t *h=mm;
+  void *newBlock=h->start+h->root->size-(2*8);//old ending block
+  void *fresh=mem_heap_zero_lo(h->mem);
+  void *old;
+
+  if(h->heapFull || (old=mem_heap_sbrk(h->mem, sizeToAlloc))==(void *)-1){
+    h->heapFull=1;
+    return addRegion(sizeToAlloc);
+  }
+  h->root->size+=sizeToAlloc;
+
+  /* last block is free, grow it over the old ending block */
+  if(!is_alloc(newBlock-8)){
+    long oldS=block_size(newBlock-8);
+    int zero=is_zero(newBlock-8) && old>=fresh;
+
+    if(zero){//old footer and ending block are data now
+      gl(newBlock-8)=0;
+      gl(newBlock)=0;
+      gl(newBlock+8)=0;
+    }
+    newBlock-=oldS+(2*8);
+    createBlock(createBlock(newBlock, oldS+sizeToAlloc, 0), 0, 1);
+    if(zero)
+      setZero(newBlock);
+    compactFix(newBlock);
+    return newBlock;
+  }
+
+  /* set first to be new block, its next is old first */
+  setPtrs(newBlock, NULL, getFirst());
+  setFirst(newBlock);
+
+  /* set new block information and the new ending block: */
+  createBlock(createBlock(newBlock, (sizeToAlloc-(2*8)), 0), 0, 1);
+  if(old>=fresh)
+    setZero(newBlock);
+  return newBlock;
+}
+
+/* Map a region of at least sizeToAlloc bytes for when the heap is
+ * full. It is laid out like the heap, a starting block, one free block
+ * and an ending block, so coalescing never leaves it. Returns the free
+ * block or NULL. 
+ */
+static void *addRegion(long sizeToAlloc){
+  long page=mem_pagesize();
+  long len=(max(REGION_MIN, sizeToAlloc+(5*8))+page-1) & ~(page-1);
+  void *lo;
+  void *block;
+
+  if(!mm->mapBig || (lo=mem_heap_region_add(mm->mem, len))==(void *)-1)
+    return NULL;
+  gp(lo)=mm->regions;
+  mm->regions=lo;
+  block=createBlock(lo+8, 0, 1);
+  setPtrs(block, NULL, getFirst());
+  setFirst(block);
+  createBlock(createBlock(block, len-(7*8), 0), 0, 1);
+  setZero(block);//fresh mapping
+  return block;
+}
+
 /* Given a pointer to the block this will allocate the data and return
  * a pointer to be returned by malloc. 
  * Assumes that the data can fit inside the block, will set alloc=1. 
@@ -184,30 +538,23 @@ void *malloc_here(void *currentBlock, long size){
   long blockSize=block_size(currentBlock);
   long newBlockSize;
   void *workingPtr=currentBlock;
-  void *prev=getPtr(currentBlock, 1);
-  void *next=getPtr(currentBlock, 2);
 
+  mm->lastZero=is_zero(currentBlock);
   /* if there is space for a header,footer,and at least
    * 16 bytes (2 words) of data then split */
   if((blockSize-size-(2*8))>=(2*8)){
     newBlockSize=blockSize-size-(2*8);
     
     workingPtr=createBlock(workingPtr, newBlockSize, 0);
+    if(mm->lastZero)
+      setZero(currentBlock);
     createBlock(workingPtr, size, 1);
     return (workingPtr+8);
   }
   else{
     setAlloc(currentBlock, 1);
     setAlloc(currentBlock+blockSize+8, 1);
-    
-    /* Set free linked info: */
-    if(first==currentBlock){//invariant that prev=null
-      if(next!=NULL)
-	set1Ptr(next, NULL, 1);
-      first=next;
-    }
-    else
-      set1Ptr(prev, next, 2);//set prev's next pointer
+    unlinkFree(currentBlock);
     return (currentBlock+8);
   }//good size block
 }
@@ -216,11 +563,19 @@ void *malloc_here(void *currentBlock, long size){
  * malloc
  */
 void *malloc (size_t size) {
-  void *currentBlock=first;
+  HEAP_LOCKED;
+  mm_heap_t *h=mm;//read the thread's heap once, not per block
+  char *base=(char *)h->root;
+  void *currentBlock=getFirst();
   long newSize=max((2*8),(ALIGN(size)));//newSize is actual size to use
   long sizeToAlloc;
   void *placeToAlloc;//only used if need more space
 
+  if(size>BLOCK_MAX)
+    return NULL;
+  if(newSize>=MAP_MIN && h->mapBig)
+    return mapBlock(newSize);
+
   /* Look at all available blocks: */
   while(currentBlock!=NULL){
     long blockSize=block_size(currentBlock);
@@ -228,26 +583,20 @@ void *malloc (size_t size) {
       printf("\nERROR: Bad free list found in malloc\n");
     if(blockSize>=newSize)//found space
       return malloc_here(currentBlock, newSize);
-    else //too small
-      currentBlock=getPtr(currentBlock, 2);
+    else{//too small, follow the next offset (getPtr)
+      long next=gl(currentBlock+(2*8));
+      currentBlock=next?base+next:NULL;
+    }
   }
 
-  /* No block will fit, add memory, 
-     currentBlock points to null block at end */
+  /* No block will fit, add memory */
   sizeToAlloc=max(START_SIZE, newSize+(2*8));
-  currentBlock=start+totalSize-(2*8);
-  if(!mem_sbrk(sizeToAlloc))
+  if((placeToAlloc=extendHeap(sizeToAlloc))==NULL){
+    /* out of memory: take back what the caches and pool hold and retry */
+    if(reclaim()>0)
+      return malloc(size);
     return NULL;
-  totalSize+=sizeToAlloc;
-  placeToAlloc=currentBlock;
-
-  /* set first to be new block, its next is old first */
-  setPtrs(currentBlock, NULL, first);
-  first=currentBlock;
-
-  /* set new block information: */
-  currentBlock=createBlock(currentBlock, (sizeToAlloc-(2*8)), 0);
-  createBlock(currentBlock, 0, 1);
+  }
 
   return malloc_here(placeToAlloc, newSize);
 }
@@ -256,27 +605,96 @@ void *malloc (size_t size) {
  * free
  */
 void free (void *ptr) {
-  long oldS;//store original size that ptr points to
-  long neighS;//neighbor size
-  void *nextPtr;//used for forwards just for ease of typing
+  HEAP_LOCKED;
+  mm_heap_t *h=mm;
+  if(!ptr)
+    return;
+  if(!in_heap(ptr)){
+    if(mem_heap_map_find(h->mem, ptr, NULL)==ptr-8)
+      unmapBlock(ptr);
+    return;
+  }
+  if(h->zpoolOn){
+    zpoolRefill();
+    if(zpoolKeep(ptr))
+      return;
+  }
+  freeBlock(ptr-8);
+}
+
+/*
+ * free_sized - free for callers that know the size they asked for. 
+ * The caller vouches for ptr so the heap bounds check is skipped, but
+ * that is all: the header still has to be read, it holds the flags
+ * and blocks can carry up to 3 words of split slack, so it is what
+ * decides the block size. With SIZED_CHECK the caller's size is
+ * checked against it, for heap blocks only as mapped blocks are
+ * rounded to whole pages. 
+ */
+void free_sized(void *ptr, size_t size){
+  HEAP_LOCKED;
+  if(!ptr)
+    return;
+  if(is_mapped(ptr-8)){
+    unmapBlock(ptr);
+    return;
+  }
+#ifdef SIZED_CHECK
+  {
+    long want=max((2*8), ALIGN(size));
+    long have=block_size(ptr-8);
+    if(have<want || have-want>=(4*8))
+      printf("ERROR: free_sized(%p, %zu) but block holds %li bytes\n", 
+	     ptr, size, have);
+  }
+#else
+  (void)size;
+#endif
+  if(mm->zpoolOn){
+    zpoolRefill();
+    if(zpoolKeep(ptr))
+      return;
+  }
+  freeBlock(ptr-8);
+}
 
-  if(!ptr || !in_heap(ptr)) 
+/* Give the pages of a big free block back to the system and mark it
+ * ZERO, the partial pages at either end are zeroed by hand. 
+ */
+void purgeBlock(void *block){
+  void *lo=block+(3*8);//past the header and list pointers
+  void *hi=block+block_size(block)+8;//the footer
+  size_t page=mem_pagesize();
+  void *pageLo=(void *)(((size_t)lo+(page-1)) & ~(page-1));
+  void *pageHi=(void *)((size_t)hi & ~(page-1));
+
+  if(pageHi<=pageLo || mem_heap_purge(mm->mem, pageLo, pageHi-pageLo)==0)
     return;
+  memset(lo, 0, pageLo-lo);
+  memset(pageHi, 0, hi-pageHi);
+  setZero(block);
+}
+
+/* Mark the allocated block with header at ptr free and coalesce it
+ * with its neighbours. Freeing a big block purges the result. 
+ */
+void freeBlock(void *ptr){
+  long oldS=block_size(ptr);//store original size that ptr points to
+  long neighS;//neighbor size
+  void *nextPtr;//used for forwards just for ease of typing
 
-  ptr-=8;
   setAlloc(ptr, 0);
   setAlloc(ptr+(block_size(ptr)+8), 0);
 
   /* Coalesce Backwards: */
    if(!is_alloc((ptr-8))){
-    oldS=block_size(ptr);
     neighS=block_size(ptr-8);
     ptr-=(neighS+(2*8));
     createBlock(ptr, neighS+oldS+(2*8), 0);
   }
   else{
-    setPtrs(ptr, NULL, first);
-    first=ptr;
+    setPtrs(ptr, NULL, getFirst());
+    setFirst(ptr);
   }
 
   /* Coalesce Forwards: 
@@ -284,23 +702,34 @@ void free (void *ptr) {
   nextPtr=ptr+block_size(ptr)+(2*8);//right neighbour
   if(!is_alloc(nextPtr)){
     void *next=getPtr(nextPtr, 2);//right neighbour's next
-    if(nextPtr==first){
+    if(nextPtr==getFirst()){
       set1Ptr(next, NULL, 1);//set next's prev to null
-      first=next;//prev should be null if it is the first
+      setFirst(next);//prev should be null if it is the first
     }
     else//nextPtr's prev!=null
       set1Ptr(getPtr(nextPtr,1), getPtr(nextPtr,2), 2);
     createBlock(ptr, block_size(ptr)+block_size(nextPtr)+(2*8), 0);
   }
+
+  compactFix(ptr);
+  if(oldS>=PURGE_MIN)
+    purgeBlock(ptr);
 }
 
 /*
  * realloc - basically coppied from mm-naive
+ * If the new size still fits in the block it stays where it is, 
+ * so growing up to malloc_usable_size never copies. Mapped blocks
+ * that stay big are remapped, never copied. 
  */
 void *realloc(void *oldptr, size_t size) {
+  HEAP_LOCKED;
   long oldSize;
+  long newSize=max((2*8),(ALIGN(size)));
   void *newptr;
 
+  if(size>BLOCK_MAX)
+    return NULL;
   if(size==0){
     free(oldptr);
     return 0;
@@ -309,101 +738,1423 @@ void *realloc(void *oldptr, size_t size) {
   if(oldptr==NULL)
     return malloc(size);
 
+  oldSize=block_size(oldptr-8);
+  if(is_mapped(oldptr-8)){
+    if(newSize>=MAP_MIN && mm->mapBig)
+      return remapBlock(oldptr, newSize);
+  }
+  else if(newSize<=oldSize){
+    /* give back the tail if it can be a block of its own */
+    if(oldSize-newSize>=(4*8)){
+      createBlock(oldptr-8, newSize, 1);
+      newptr=oldptr+newSize+8;
+      createBlock(newptr, oldSize-newSize-(2*8), 1);
+      freeBlock(newptr);
+    }
+    return oldptr;
+  }
+
   newptr=malloc(size);
   if(!newptr)
     return 0;
 
-  oldSize=min(size, block_size(oldptr-8));
-
-  memcpy(newptr, oldptr, oldSize);
+  mm_copy(newptr, oldptr, min(oldSize, newSize));
   free(oldptr);
   return newptr;
 }
 
+/*
+ * malloc_batch - allocate n blocks of size bytes into out, returns
+ * how many it got (less than n only if out of memory). Each free
+ * block found is carved into as many blocks as it holds before the
+ * search moves on. 
+ */
+size_t malloc_batch(size_t size, size_t n, void **out){
+  HEAP_LOCKED;
+  void *currentBlock=getFirst();
+  long newSize=max((2*8),(ALIGN(size)));
+  size_t got=0;
+
+  if(size>BLOCK_MAX)
+    return 0;
+  if(newSize>=MAP_MIN && mm->mapBig){
+    for(; got<n; got++)
+      if((out[got]=mapBlock(newSize))==NULL)
+	break;
+    return got;
+  }
+
+  while(got<n){
+    long blockSize;
+    long carve;//how many blocks come off this one
+    int zero;
+    void *next;
+    void *end;
+
+    if(currentBlock==NULL){
+      /* nothing left fits, add room for all of the rest at once */
+      currentBlock=extendHeap(max(START_SIZE, (n-got)*(newSize+(2*8))));
+      if(currentBlock==NULL){
+	if(reclaim()>0){
+	  currentBlock=getFirst();
+	  continue;
+	}
+	break;
+      }
+    }
+
+    blockSize=block_size(currentBlock);
+    next=getPtr(currentBlock, 2);
+    if(blockSize<newSize){//too small
+      currentBlock=next;
+      continue;
+    }
+
+    /* carve blocks off the end in address order, the front keeps
+     * its list links and at least 2 words of data */
+    carve=min(n-got, (blockSize-(2*8))/(newSize+(2*8)));
+    blockSize-=carve*(newSize+(2*8));
+    zero=is_zero(currentBlock);
+    end=createBlock(currentBlock, blockSize, 0);
+    if(zero)
+      setZero(currentBlock);
+    for(; carve>0; carve--, got++){
+      out[got]=end+8;
+      end=createBlock(end, newSize, 1);
+    }
+    if(got<n && blockSize>=newSize)//what is left is one more block
+      out[got++]=malloc_here(currentBlock, newSize);
+    currentBlock=next;
+  }
+  return got;
+}
+
+#define RUN_SHARE 8//free_batch sorts if runs are shorter than this
+
+/* orders pointers by address for qsort
+ */
+static int ptrCompare(const void *a, const void *b){
+  char *pa=*(char * const *)a;
+  char *pb=*(char * const *)b;
+  return (pa>pb)-(pa<pb);
+}
+
+/*
+ * free_batch - free n blocks, may sort ptrs in place by address. 
+ * Blocks that sit next to each other are joined into one before
+ * being freed, so a run of neighbours coalesces only once. 
+ */
+void free_batch(void **ptrs, size_t n){
+  HEAP_LOCKED;
+  size_t i;
+  size_t runs=1;
+
+  /* a batch from malloc_batch is already a few runs of neighbours, 
+   * only sort when the blocks are scattered */
+  for(i=1; i<n; i++)
+    if(!ptrs[i-1] || ptrs[i]!=ptrs[i-1]+block_size(ptrs[i-1]-8)+(2*8))
+      runs++;
+  if(runs>n/RUN_SHARE)
+    qsort(ptrs, n, sizeof(void *), ptrCompare);
+
+  i=0;
+  while(i<n){
+    void *block;
+    void *end;
+
+    if(!ptrs[i] || !in_heap(ptrs[i])){
+      free(ptrs[i]);//mapped blocks
+      i++;
+      continue;
+    }
+    block=ptrs[i]-8;
+    end=block+block_size(block)+(2*8);
+    for(i++; i<n && ptrs[i]==end+8; i++)
+      end+=block_size(end)+(2*8);
+    createBlock(block, end-block-(2*8), 1);
+    freeBlock(block);
+  }
+}
+
+/*
+ * malloc_usable_size - how many bytes the block at ptr can really
+ * hold, at least what was asked for. 
+ */
+size_t malloc_usable_size(void *ptr){
+  if(ptr==NULL)
+    return 0;
+  return block_size(ptr-8);
+}
+
+/*
+ * malloc_good_size - the usable size malloc(size) will give at least, 
+ * asking for exactly this much wastes nothing to rounding. Sizes malloc
+ * can't give come back unchanged. 
+ */
+size_t malloc_good_size(size_t size){
+  size_t page=mem_pagesize();
+  size_t good;
+
+  if(size>BLOCK_MAX)//malloc fails, and ALIGN could wrap
+    return size;
+  good=(size<(2*8))?(2*8):ALIGN(size);
+  if(good>=MAP_MIN && mm->mapBig)//mapped with its header, in whole pages
+    good=((good+8+page-1)&~(page-1))-8;
+  return good;
+}
+
 /*
  * calloc - you may want to look at mm-naive.c
  * This function is not tested by mdriver, but it is
  * needed to run the traces.
  *
  * Same code as in mm-naive but added in test for NULL
+ * Skips zeroing memory that is known to be zero already: fresh heap
+ * from mem_sbrk, purged blocks and new mappings. 
  */
 void *calloc (size_t nmemb, size_t size) {
+  HEAP_LOCKED;
   size_t bytes = nmemb * size;
   void *newptr;
 
+  if(nmemb!=0 && bytes/nmemb!=size)//overflow
+    return NULL;
+  if(mm->zpoolOn && (newptr=zpoolTake(bytes))!=NULL)
+    return newptr;
   newptr = malloc(bytes);
   if(newptr==NULL)
     return NULL;
-  memset(newptr, 0, bytes);
+  /* a ZERO block only has the list pointers to clear */
+  if(mm->lastZero)
+    mm_zero(newptr, min(bytes, (2*8)));
+  else
+    mm_zero(newptr, bytes);
 
   return newptr;
 }
 
+/* Returns where a payload aligned to align can start in the free
+ * block, or NULL if size bytes won't fit there. Any slack in front
+ * of the payload has to be big enough to stay a free block. 
+ */
+void *alignedFit(void *block, size_t align, long size){
+  void *lo=block+8;//payload if there is no slack
+  void *p=(void *)(((size_t)lo+(align-1)) & ~(align-1));
+
+  if(p!=lo && p-lo<(4*8))
+    p=(void *)(((size_t)lo+(4*8)+(align-1)) & ~(align-1));
+  if(p+size+8>block+block_size(block)+(2*8))
+    return NULL;
+  return p;
+}
+
+/* Allocate size bytes at p inside a free block, p from alignedFit. 
+ * The slack in front stays in the free list as a smaller free block
+ * and a big enough tail is split off as a new free block. 
+ */
+void *malloc_aligned_here(void *block, void *p, long size){
+  void *end=block+block_size(block)+(2*8);//end of the free block
+  void *here=p-8;//header of the allocated block
+  void *tail=p+size+8;
+  long lead=here-block;
+  int zero=is_zero(block);
+
+  if(lead==0)
+    unlinkFree(block);
+  else{
+    createBlock(block, lead-(2*8), 0);
+    if(zero)
+      setZero(block);
+  }
+
+  if(end-tail>=(4*8)){
+    setPtrs(tail, NULL, getFirst());
+    setFirst(tail);
+    createBlock(tail, (end-tail)-(2*8), 0);
+    if(zero)
+      setZero(tail);
+  }
+  else
+    size+=end-tail;//too small to be a block, keep it
+  createBlock(here, size, 1);
+  return p;
+}
+
 /*
- * Return whether the pointer is in the heap.
- * May be useful for debugging.
+ * memalign - malloc with the payload aligned to align bytes, 
+ * align has to be a power of 2. 
  */
-static int in_heap(const void *p) {
-    return p <= mem_heap_hi() && p >= mem_heap_lo();
+void *memalign(size_t align, size_t size){
+  HEAP_LOCKED;
+  void *currentBlock=getFirst();
+  long newSize=max((2*8),(ALIGN(size)));
+  void *p;
+
+  if(align==0 || (align&(align-1)) || size>BLOCK_MAX || align>BLOCK_MAX)
+    return NULL;
+  if(align<=ALIGNMENT)
+    return malloc(size);
+
+  /* Look at all available blocks: */
+  while(currentBlock!=NULL){
+    if((p=alignedFit(currentBlock, align, newSize))!=NULL)
+      return malloc_aligned_here(currentBlock, p, newSize);
+    currentBlock=getPtr(currentBlock, 2);
+  }
+
+  /* Add enough memory to fit even the worst placement */
+  currentBlock=extendHeap(max(START_SIZE, newSize+align+(6*8)));
+  if(currentBlock==NULL){
+    if(reclaim()>0)
+      return memalign(align, size);
+    return NULL;
+  }
+  p=alignedFit(currentBlock, align, newSize);
+  return malloc_aligned_here(currentBlock, p, newSize);
 }
 
 /*
- * Return whether the pointer is aligned.
- * May be useful for debugging.
+ * posix_memalign - memalign that reports errors like POSIX wants, 
+ * align also has to be a multiple of sizeof(void *). 
  */
-static int aligned(const void *p) {
-    return (size_t)ALIGN(p) == (size_t)p;
+int posix_memalign(void **memptr, size_t align, size_t size){
+  void *p;
+
+  if(align==0 || align%sizeof(void *)!=0 || (align&(align-1)))
+    return EINVAL;
+  if((p=memalign(align, size))==NULL)
+    return ENOMEM;
+  *memptr=p;
+  return 0;
 }
 
 /*
- * mm_checkheap
+ * aligned_alloc - C11 name for memalign
  */
-void mm_checkheap(int verbose) {
-  void *currentBlock=start;
+void *aligned_alloc(size_t align, size_t size){
+  return memalign(align, size);
+}
 
-  if(verbose>=2){
-    if(gl(currentBlock)!=1)
-      printf("ERROR: Bad dummy starter header: %li => %li, %li\n", 
-	     gl(currentBlock), 
-	     block_size(currentBlock), is_alloc(currentBlock));
-    currentBlock+=8;
-    if(gl(currentBlock)!=1)
-      printf("ERROR: Bad dummy starter footer: %li => %li, %li\n", 
-	     gl(currentBlock), 
-	     block_size(currentBlock), is_alloc(currentBlock));
+/***** Mapped blocks: *****/
+
+/* A mapped block is a header word at the start of its own mapping
+ * followed by the payload, size covers the rest of the mapping. 
+ */
+/* Make a mapped block of at least size bytes, returns the payload
+ */
+void *mapBlock(long size){
+  void *p=mem_heap_map(mm->mem, size+8);
+  size_t len;
+
+  if(p==(void *)-1)
+    return NULL;
+  mem_heap_map_find(mm->mem, p, &len);
+  gl(p)=((len-8)<<1)|MAPPED|1;
+  mm->lastZero=1;//fresh pages
+  return p+8;
+}
+
+/* Resize the mapped block with payload ptr to at least size bytes, 
+ * returns the new payload or NULL with the old block left alone
+ */
+void *remapBlock(void *ptr, long size){
+  void *p=mem_heap_remap(mm->mem, ptr-8, size+8);
+  size_t len;
+
+  if(p==(void *)-1)
+    return NULL;
+  mem_heap_map_find(mm->mem, p, &len);
+  gl(p)=((len-8)<<1)|MAPPED|1;
+  return p+8;
+}
+
+/* Give back the mapped block with payload ptr
+ */
+void unmapBlock(void *ptr){
+  mem_heap_unmap(mm->mem, ptr-8);
+}
+
+/***** Copy and zero kernels: *****/
+
+/* realloc copies and calloc zeroes with these. Up to SMALL_MOVE
+ * bytes are done inline with a few overlapping moves, where a libc
+ * call would cost more than the move. Copies up to MID_MOVE use a loop
+ * that mm_init picks for the CPU (AVX2 or SSE2). Anything bigger than
+ * the last level cache uses non-temporal stores, as it would only push
+ * everything else out of the cache. libc handles the sizes between. 
+ */
+#ifdef __x86_64__
+#define SMALL_MOVE 64
+#define MID_MOVE 256//libc's own dispatch is as good past this
+#define LLC_DEFAULT (8<<20)//for when sysconf doesn't know
+
+#define ld16(p) _mm_loadu_si128((const __m128i *)(p))
+#define st16(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+
+void copyMidSSE2(char *d, const char *s, size_t n);
+void (*copyMid)(char *d, const char *s, size_t n)=copyMidSSE2;
+size_t streamMin=LLC_DEFAULT;
+
+/* n is at most SMALL_MOVE, the head and tail moves overlap in the
+ * middle rather than looping */
+static inline void copySmall(char *d, const char *s, size_t n){
+  if(n>=32){
+    __m128i a=ld16(s), b=ld16(s+16), c=ld16(s+n-32), e=ld16(s+n-16);
+    st16(d, a); st16(d+16, b); st16(d+n-32, c); st16(d+n-16, e);
+  }
+  else if(n>=16){
+    __m128i a=ld16(s), b=ld16(s+n-16);
+    st16(d, a); st16(d+n-16, b);
+  }
+  else if(n>=8){
+    unsigned long a=*(const unsigned long *)s;
+    unsigned long b=*(const unsigned long *)(s+n-8);
+    *(unsigned long *)d=a; *(unsigned long *)(d+n-8)=b;
   }
+  else
+    while(n--)
+      *d++=*s++;
+}
 
-  if(verbose>=3){
-    int freeCount=0;
-    int totalBlockCount=0;
-    currentBlock+=8;
+static inline void zeroSmall(char *d, size_t n){
+  __m128i z=_mm_setzero_si128();
 
-    while(block_size(currentBlock)!=0){
-      totalBlockCount++;
-      if(!is_alloc(currentBlock))
-	freeCount++;
-      if(!in_heap(currentBlock))
-	printf("ERROR: Out of heap\n");
-      if(!aligned(currentBlock))
-	printf("ERROR: Not aligned\n");
-      
-      /* header and footer information is the same */
-      if(gl(currentBlock)!=
-	 gl(currentBlock+block_size(currentBlock)+8)){
-	printf("ERROR: Header and Footer don't match up\n");
-	break;
-      }
-      
-      /* if current block is not allocated make sure the next one is
-       * only check inforward direction because every block checks
-       */
-      if(!(is_alloc(currentBlock) || 
-	   is_alloc(currentBlock+block_size(currentBlock)+(2*8))))
-	printf("ERROR: coalescing fail\n");
-      currentBlock+=block_size(currentBlock)+(2*8);
-    }//check all middle blocks
-
-    currentBlock=first;
+  if(n>=32){
+    st16(d, z); st16(d+16, z); st16(d+n-32, z); st16(d+n-16, z);
+  }
+  else if(n>=16){
+    st16(d, z); st16(d+n-16, z);
+  }
+  else if(n>=8){
+    *(unsigned long *)d=0; *(unsigned long *)(d+n-8)=0;
+  }
+  else
+    while(n--)
+      *d++=0;
+}
+
+/* The mid copies take n > SMALL_MOVE. They move the first 64 bytes
+ * unaligned, run from the first 64 byte boundary of d so no store
+ * splits a cache line, and finish with an overlapping last 64. */
+void copyMidSSE2(char *d, const char *s, size_t n){
+  size_t i;
+
+  copySmall(d, s, 64);
+  for(i=(-(size_t)d) & 63; i+64<n; i+=64){
+    __m128i a=ld16(s+i), b=ld16(s+i+16), c=ld16(s+i+32), e=ld16(s+i+48);
+    st16(d+i, a); st16(d+i+16, b); st16(d+i+32, c); st16(d+i+48, e);
+  }
+  copySmall(d+n-64, s+n-64, 64);
+}
+
+__attribute__((target("avx2")))
+void copyMidAVX2(char *d, const char *s, size_t n){
+  size_t i;
+
+  copySmall(d, s, 64);
+  for(i=(-(size_t)d) & 63; i+64<n; i+=64){
+    __m256i a=_mm256_loadu_si256((const __m256i *)(s+i));
+    __m256i b=_mm256_loadu_si256((const __m256i *)(s+i+32));
+    _mm256_storeu_si256((__m256i *)(d+i), a);
+    _mm256_storeu_si256((__m256i *)(d+i+32), b);
+  }
+  copySmall(d+n-64, s+n-64, 64);
+}
+
+/* Streaming versions for n >= streamMin, laid out like the mid copies
+ */
+void copyStream(char *d, const char *s, size_t n){
+  size_t head=(-(size_t)d) & 63;
+  size_t i;
+
+  copySmall(d, s, 64);
+  for(i=head; i+64<=n; i+=64){
+    __m128i a=ld16(s+i), b=ld16(s+i+16), c=ld16(s+i+32), e=ld16(s+i+48);
+    _mm_stream_si128((__m128i *)(d+i), a);
+    _mm_stream_si128((__m128i *)(d+i+16), b);
+    _mm_stream_si128((__m128i *)(d+i+32), c);
+    _mm_stream_si128((__m128i *)(d+i+48), e);
+  }
+  _mm_sfence();
+  copySmall(d+n-64, s+n-64, 64);
+}
+
+void zeroStream(char *d, size_t n){
+  size_t head=(-(size_t)d) & 63;
+  __m128i z=_mm_setzero_si128();
+  size_t i;
+
+  zeroSmall(d, 64);
+  for(i=head; i+64<=n; i+=64){
+    _mm_stream_si128((__m128i *)(d+i), z);
+    _mm_stream_si128((__m128i *)(d+i+16), z);
+    _mm_stream_si128((__m128i *)(d+i+32), z);
+    _mm_stream_si128((__m128i *)(d+i+48), z);
+  }
+  _mm_sfence();
+  zeroSmall(d+n-64, 64);
+}
+
+/* Called once by the first mm_init: pick the mid copy and the streaming threshold
+ */
+void kernelInit(void){
+  long llc=sysconf(_SC_LEVEL3_CACHE_SIZE);
+
+  streamMin=(llc>0)?(size_t)llc:LLC_DEFAULT;
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2"))
+    copyMid=copyMidAVX2;
+}
+
+/*
+ * mm_copy - memcpy for non-overlapping d and s, sized for blocks. 
+ */
+void mm_copy(void *d, const void *s, size_t n){
+  if(n<=SMALL_MOVE)
+    copySmall(d, s, n);
+  else if(n<=MID_MOVE)
+    copyMid(d, s, n);
+  else if(n<streamMin)
+    memcpy(d, s, n);
+  else
+    copyStream(d, s, n);
+}
+
+/*
+ * mm_zero - memset to 0, sized for blocks. 
+ */
+void mm_zero(void *d, size_t n){
+  if(n<=SMALL_MOVE)
+    zeroSmall(d, n);
+  else if(n<streamMin)
+    memset(d, 0, n);
+  else
+    zeroStream(d, n);
+}
+#else
+void kernelInit(void){}
+
+void mm_copy(void *d, const void *s, size_t n){
+  memcpy(d, s, n);
+}
+
+void mm_zero(void *d, size_t n){
+  memset(d, 0, n);
+}
+#endif
+
+/***** Pre-zeroed pool: *****/
+
+/* With the pool on, free keeps blocks of ZPOOL_MIN to ZPOOL_MAX bytes
+ * for calloc instead of freeing them. Pooled blocks stay allocated as
+ * far as the heap is concerned. They wait on the dirty list until a
+ * later free zeroes one and moves it to the clean list of its size
+ * class, so each free does at most one block's worth of zeroing. 
+ * Pooled blocks are zeroed with mm_zero, so through the cache: they
+ * are at most ZPOOL_MAX bytes and the caller of calloc usually writes
+ * to its block straight away, which non-temporal stores would leave
+ * to miss in the cache. 
+ * The first word of a pooled block links it into its list. 
+ */
+/* Called by free: keep the block at ptr for the pool if it is the
+ * right size and its class has room. Returns 1 if it was kept. 
+ */
+int zpoolKeep(void *ptr){
+  long size=block_size(ptr-8);
+  int k;
+
+  if(size<ZPOOL_MIN || size>ZPOOL_MAX)
+    return 0;
+  k=zpoolClass(size);
+  if(mm->zpoolCount[k]>=ZPOOL_DEPTH)
+    return 0;
+  mm->zpoolCount[k]++;
+  gp(ptr)=mm->zpoolDirty;
+  mm->zpoolDirty=ptr;
+  return 1;
+}
+
+/* Called by free: zero one dirty block and make it clean
+ */
+void zpoolRefill(void){
+  void *ptr=mm->zpoolDirty;
+  long size;
+  int k;
+
+  if(ptr==NULL)
+    return;
+  mm->zpoolDirty=gp(ptr);
+  size=block_size(ptr-8);
+  k=zpoolClass(size);
+  mm_zero(ptr, size);
+  gp(ptr)=mm->zpoolClean[k];
+  mm->zpoolClean[k]=ptr;
+}
+
+/* Called by calloc: a clean block of at least bytes, NULL if the pool
+ * has none. Looks through the class of bytes, then takes any block
+ * from the class above. 
+ */
+void *zpoolTake(size_t bytes){
+  long newSize=max((2*8),(ALIGN(bytes)));
+  void **pp;
+  void *ptr;
+  int k;
+
+  if(newSize<ZPOOL_MIN || newSize>ZPOOL_MAX)
+    return NULL;
+  k=zpoolClass(newSize);
+  for(pp=&mm->zpoolClean[k]; *pp!=NULL; pp=(void **)*pp)
+    if(block_size(*pp-8)>=newSize)
+      break;
+  if(*pp==NULL && k+1<ZPOOL_CLASSES)
+    pp=&mm->zpoolClean[++k];
+  if((ptr=*pp)==NULL)
+    return NULL;
+
+  *pp=gp(ptr);
+  gp(ptr)=NULL;//the link was the only non-zero word
+  mm->zpoolCount[k]--;
+  return ptr;
+}
+
+/* Free everything in the pool for real, returns the bytes freed
+ */
+size_t zpoolDrain(void){
+  size_t drained=0;
+  void *ptr;
+  int k;
+
+  for(k=-1; k<ZPOOL_CLASSES; k++){
+    void **list=(k<0)?&mm->zpoolDirty:&mm->zpoolClean[k];
+    while((ptr=*list)!=NULL){
+      *list=gp(ptr);
+      drained+=block_size(ptr-8);
+      freeBlock(ptr-8);
+    }
+  }
+  for(k=0; k<ZPOOL_CLASSES; k++)
+    mm->zpoolCount[k]=0;
+  return drained;
+}
+
+/*
+ * mm_zpool_enable - turn the pre-zeroed pool for calloc on or off, 
+ * turning it off frees whatever it holds. It stays off on a file or
+ * shared heap, where pooled blocks would outlive the process. 
+ */
+void mm_zpool_enable(int on){
+  mm->zpoolOn=on && mm->mapBig;
+  if(!on)
+    zpoolDrain();
+}
+
+/***** Shared heaps: *****/
+
+/* A heap from mem_init_shared is used by several processes at once,
+ * each with the heap mapped at its own address, which the offsets in
+ * the heap allow. Every entry point holds root->lock, a robust process
+ * shared mutex, so a process that dies holding it doesn't block the
+ * others. What it was doing to the heap is then left half done. 
+ */
+
+/* Take the heap lock if the heap is shared, returns whether it did
+ */
+static int heapLock(void){
+  if(!mm->shared)
+    return 0;
+  if(pthread_mutex_lock(&mm->root->lock)==EOWNERDEAD)
+    pthread_mutex_consistent(&mm->root->lock);
+  mm->hslots=fromOff(mm->root->hslots);//may have been moved by another process
+  return 1;
+}
+/* Cleanup for HEAP_LOCKED
+ */
+static void heapUnlock(int *held){
+  if(*held)
+    pthread_mutex_unlock(&mm->root->lock);
+}
+
+/***** Handles: *****/
+
+/* A handle names a slot in the hslots table, which holds the payload
+ * of its block. The first word of the payload is the handle word: the
+ * slot (so the compactor, walking the heap, can find the slot to
+ * update when it moves the block) and above it the lock count. The
+ * rest is the caller's. Slots hold offsets like the free list does,
+ * free slots hold the next free slot as an odd number. Handle blocks
+ * are flagged HANDLE, handles of MAP_MIN bytes or more are mapped
+ * like other big blocks and never move. 
+ */
+#define HSLOTS_MIN 8
+#define HLOCK (1L<<32)//one lock in a handle word
+#define TRIM_SLACK (1<<16)//least free tail mm_hcompact leaves
+#define hw_slot(p) (gl(p) & (HLOCK-1))//p is the payload
+#define hw_locks(p) (gl(p)>>32)
+#define hs_block(h) ((char *)fromOff(mm->hslots[(h)-1]))
+
+/* Mark block as a handle block with its slot
+ */
+static void handleMark(void *block, long slot){
+  if(!is_mapped(block)){
+    gl(block)|=HANDLE;
+    gl(block+block_size(block)+8)|=HANDLE;
+  }
+  gl(block+8)=slot;
+}
+/* Make block a plain block again before it goes back to malloc
+ */
+static void handleUnmark(void *block){
+  if(is_mapped(block))
+    return;
+  gl(block)&=~HANDLE;
+  gl(block+block_size(block)+8)&=~HANDLE;
+}
+
+/*
+ * mm_halloc - allocate size bytes behind a handle, 0 if out of memory
+ */
+mm_handle_t mm_halloc(size_t size){
+  HEAP_LOCKED;
+  void *p;
+  long slot;
+
+  if(size>BLOCK_MAX)
+    return 0;
+  if(mm->root->freeHslot<0){
+    long n=max(HSLOTS_MIN, mm->root->numHslots+mm->root->numHslots/2);
+    long *grown=realloc(mm->hslots, n*sizeof(long));
+    if(grown==NULL)
+      return 0;
+    mm->hslots=grown;
+    mm->root->hslots=toOff(grown);
+    for(slot=n-1; slot>=mm->root->numHslots; slot--){
+      mm->hslots[slot]=2*mm->root->freeHslot+1;
+      mm->root->freeHslot=slot;
+    }
+    mm->root->numHslots=n;
+  }
+  if((p=malloc(size+8))==NULL)
+    return 0;
+  slot=mm->root->freeHslot;
+  mm->root->freeHslot=(mm->hslots[slot]-1)/2;
+  mm->hslots[slot]=toOff(p);
+  handleMark(p-8, slot);
+  return slot+1;
+}
+
+/*
+ * mm_hlock - pin the block of h and return where its data is, 
+ * locks nest. NULL for handle 0
+ */
+void *mm_hlock(mm_handle_t h){
+  HEAP_LOCKED;
+  char *p;
+
+  if(h==0)
+    return NULL;
+  p=hs_block(h);
+  gl(p)+=HLOCK;
+  return p+8;
+}
+
+/*
+ * mm_hunlock - undo one mm_hlock, the block may move once unlocked,
+ * 0 is ignored
+ */
+void mm_hunlock(mm_handle_t h){
+  HEAP_LOCKED;
+  if(h==0)
+    return;
+  gl(hs_block(h))-=HLOCK;
+}
+
+/*
+ * mm_hrealloc - resize the block of h, which must not be locked. 
+ * Returns 0, or -1 leaving the block as it was. 
+ */
+int mm_hrealloc(mm_handle_t h, size_t size){
+  HEAP_LOCKED;
+  char *old=hs_block(h);
+  void *p;
+
+  if(hw_locks(old)>0)
+    return -1;
+  handleUnmark(old-8);
+  if((p=realloc(old, size+8))==NULL){
+    handleMark(old-8, h-1);
+    return -1;
+  }
+  mm->hslots[h-1]=toOff(p);
+  handleMark(p-8, h-1);
+  return 0;
+}
+
+/*
+ * mm_hfree - free the block of h, 0 is ignored
+ */
+void mm_hfree(mm_handle_t h){
+  HEAP_LOCKED;
+  if(h==0)
+    return;
+  handleUnmark(hs_block(h)-8);
+  free(hs_block(h));
+  mm->hslots[h-1]=2*mm->root->freeHslot+1;
+  mm->root->freeHslot=h-1;
+}
+
+/* Called when block has just become free: if the compactor was
+ * looking at a block that has been swallowed by it, look at block. 
+ */
+void compactFix(void *block){
+  if(mm->compactAt>block && mm->compactAt<block+block_size(block)+(2*8))
+    mm->compactAt=block;
+}
+
+/* Slide next, a handle block or the hslots table, down over the free
+ * block before it, which moves to after it. Returns the free block. 
+ */
+static void *compactSlide(void *block, void *next){
+  long freeS=block_size(block);
+  long nextS=block_size(next);
+  int table=(next+8==(void *)mm->hslots);
+  void *rest;
+
+  unlinkFree(block);
+  memmove(block+8, next+8, nextS);
+  createBlock(block, nextS, 1);
+  if(table){
+    mm->hslots=block+8;
+    mm->root->hslots=toOff(mm->hslots);
+  }
+  else{
+    long slot=hw_slot(block+8);
+    handleMark(block, slot);
+    mm->hslots[slot]=toOff(block+8);
+  }
+  rest=block+nextS+(2*8);
+  createBlock(rest, freeS, 1);
+  freeBlock(rest);
+  return rest;
+}
+
+/* Give the free tail back to the system once it is well past what the
+ * heap needs, keeping slack free at the end so the next few mallocs
+ * don't grow the heap straight back. 
+ */
+static size_t compactTrim(void){
+  void *end=mm->start+totalSize-(2*8);//ending block
+  long slack=(long)ALIGN(max(TRIM_SLACK, totalSize/8));
+  void *last;
+  long trim;
+
+  if(is_alloc(end-8) || block_size(end-8)<2*slack)
+    return 0;
+  last=end-block_size(end-8)-(2*8);
+  trim=block_size(last)-slack;
+  unlinkFree(last);
+  createBlock(createBlock(last, slack, 0), 0, 1);
+  setPtrs(last, NULL, getFirst());
+  setFirst(last);
+  mem_heap_sbrk(mm->mem, -trim);
+  totalSize-=trim;
+  mm->heapFull=0;
+  return trim;
+}
+
+/*
+ * mm_hcompact - slide unlocked handle blocks down the heap toward
+ * mem_heap_lo, moving about budget bytes (stepping over a block counts
+ * as a word). Each call carries on where the last one stopped, after
+ * reaching the end of the heap the free tail is trimmed. Returns the
+ * bytes moved plus the bytes trimmed. 
+ */
+size_t mm_hcompact(size_t budget){
+  HEAP_LOCKED;
+  size_t done=0;
+  size_t spent=0;
+
+  if(mm->compactAt==NULL || mm->shared)//others may have moved blocks under it
+    mm->compactAt=mm->start+(2*8);
+  while(spent<budget){
+    void *block=mm->compactAt;
+    void *next;
+
+    if(block_size(block)==0){//ending block
+      done+=compactTrim();
+      mm->compactAt=mm->start+(2*8);
+      break;
+    }
+    next=block+block_size(block)+(2*8);
+    spent+=8;
+    if(is_alloc(block) || block_size(next)==0)
+      mm->compactAt=next;
+    else if((is_handle(next) && hw_locks(next+8)==0) || next+8==(void *)mm->hslots){
+      mm->compactAt=compactSlide(block, next);
+      done+=block_size(block);
+      spent+=block_size(block);
+    }
+    else
+      mm->compactAt=next+block_size(next)+(2*8);
+  }
+  return done;
+}
+
+/***** Object caches: *****/
+
+/* Every slot in a slab is the object followed by one tag word. 
+ * While the object is allocated the tag points to its slab, while it
+ * is free the tag links it into the slab's free list. The object
+ * itself is never written by the cache so it keeps whatever state
+ * the constructor (and the user) left in it. 
+ */
+#define SLAB_BYTES (1<<12)//minimum size of a slab
+#define SLAB_MIN_OBJS 8//a slab holds at least this many objects
+#define slot_tag(c, obj) gp((char *)(obj)+(c)->tagOffset)
+#define MESH_SLOTS 256//most objects in a span
+#define MESH_WORDS (MESH_SLOTS/64)
+#define MESH_MAX 4//most pages meshed onto one
+#define MESH_PROBES 64//spans mm_cache_mesh tries against each one
+
+typedef struct slab {
+  mm_cache_t *cache;
+  struct slab *prev;
+  struct slab *next;
+  void *freeObjs;//first free object, tags link the rest
+  long inUse;//objects handed out from this slab
+} slab_t;
+
+/* In mesh mode a slab is a span: an arena page of objects, described
+ * out of band since the page may be shared. Meshed spans show the same
+ * memory through up to MESH_MAX pages. freeObjs isn't used, the live
+ * bitmap says which slots are handed out. 
+ */
+typedef struct {
+  slab_t slab;
+  unsigned long live[MESH_WORDS];
+  char *pages[MESH_MAX];//pages[0] shows its own file page
+  int npages;
+} span_t;
+
+static slab_t *spanCreate(mm_cache_t *c);
+static void spanDrop(mm_cache_t *c, slab_t *s, int destruct);
+
+struct mm_cache {
+  size_t size;//object size given by the user
+  size_t align;
+  size_t tagOffset;//where the tag word sits in a slot
+  size_t stride;//distance between slots
+  long perSlab;
+  size_t slabSize;//bytes malloced per slab
+  void (*ctor)(void *);
+  void (*dtor)(void *);
+  slab_t *partial;//slabs with some free objects
+  slab_t *full;//slabs with no free objects
+  slab_t *empty;//slabs with every object free, reapable
+  int mesh;//slabs are spans in the arena, see mesh mode below
+  int mapped;//record and slabs are mappings of their own, see cacheGet
+  mm_cache_t *nextCache;
+};
+
+/* Memory for a cache's record and slabs: from malloc, or if mapped
+ * (the heap is a file or shared heap, which outlives the process while
+ * caches don't) from a mapping of its own so none is left in the heap. 
+ * Returns NULL if out of memory. 
+ */
+static void *cacheGet(int mapped, size_t size){
+  void *p;
+
+  if(!mapped)
+    return malloc(size);
+  p=mem_heap_map(mm->mem, size);
+  return (p==(void *)-1)?NULL:p;
+}
+/* Give back p from cacheGet
+ */
+static void cachePut(int mapped, void *p){
+  if(mapped)
+    mem_heap_unmap(mm->mem, p);
+  else
+    free(p);
+}
+
+/* Take s off the list starting at *list
+ */
+static void slabUnlink(slab_t **list, slab_t *s){
+  if(s->prev!=NULL)
+    s->prev->next=s->next;
+  else
+    *list=s->next;
+  if(s->next!=NULL)
+    s->next->prev=s->prev;
+}
+/* Put s at the front of the list starting at *list
+ */
+static void slabPush(slab_t **list, slab_t *s){
+  s->prev=NULL;
+  s->next=*list;
+  if(*list!=NULL)
+    (*list)->prev=s;
+  *list=s;
+}
+
+/* Get a new slab from malloc and construct all of its objects. 
+ * The new slab goes on the empty list. Returns NULL if malloc fails. 
+ */
+static slab_t *slabCreate(mm_cache_t *c){
+  slab_t *s=cacheGet(c->mapped, c->slabSize);
+  char *obj;
+  long i;
+
+  if(s==NULL)
+    return NULL;
+  s->cache=c;
+  s->inUse=0;
+  s->freeObjs=NULL;
+  obj=(char *)(((size_t)(s+1)+(c->align-1)) & ~(c->align-1));
+  obj+=(c->perSlab-1)*c->stride;
+  /* push back to front so the free list runs in address order */
+  for(i=0; i<c->perSlab; i++, obj-=c->stride){
+    if(c->ctor!=NULL)
+      c->ctor(obj);
+    slot_tag(c, obj)=s->freeObjs;
+    s->freeObjs=obj;
+  }
+  slabPush(&c->empty, s);
+  return s;
+}
+/* Destruct every object of a slab with nothing allocated and
+ * give it back to malloc. 
+ */
+static void slabDestroy(mm_cache_t *c, slab_t *s){
+  void *obj=s->freeObjs;
+
+  if(c->mesh){
+    spanDrop(c, s, 1);
+    return;
+  }
+  while(obj!=NULL){
+    void *next=slot_tag(c, obj);
+    if(c->dtor!=NULL)
+      c->dtor(obj);
+    obj=next;
+  }
+  cachePut(c->mapped, s);
+}
+
+/*
+ * mm_cache_create - make a cache of objects of size bytes aligned to
+ * align (a power of 2, 0 for the default). ctor is run once on every
+ * object when its slab is created and dtor once when the slab is
+ * reaped, either may be NULL. 
+ */
+mm_cache_t *mm_cache_create(size_t size, size_t align,
+                            void (*ctor)(void *), void (*dtor)(void *)){
+  mm_cache_t *c;
+
+  if(align<ALIGNMENT)
+    align=ALIGNMENT;
+  if(align&(align-1))
+    return NULL;
+  c=cacheGet(!mm->mapBig, sizeof(mm_cache_t));
+  if(c==NULL)
+    return NULL;
+  c->mapped=!mm->mapBig;
+  c->size=size;
+  c->align=align;
+  c->tagOffset=ALIGN(max(size, 1));
+  c->stride=(c->tagOffset+8+(align-1)) & ~(align-1);
+  c->perSlab=max(SLAB_MIN_OBJS,
+                 ((long)SLAB_BYTES-(long)sizeof(slab_t)-(long)align)/
+                 (long)c->stride);
+  c->slabSize=sizeof(slab_t)+(align-ALIGNMENT)+c->perSlab*c->stride;
+  c->ctor=ctor;
+  c->dtor=dtor;
+  c->partial=NULL;
+  c->full=NULL;
+  c->empty=NULL;
+  c->mesh=0;
+  c->nextCache=mm->caches;
+  mm->caches=c;
+  return c;
+}
+
+/*
+ * mm_cache_alloc - hand out a constructed object, NULL if out of memory
+ */
+void *mm_cache_alloc(mm_cache_t *c){
+  slab_t *s=c->partial;
+  void *obj;
+
+  if(s==NULL){
+    s=c->empty;
+    if(s==NULL && (s=(c->mesh?spanCreate(c):slabCreate(c)))==NULL)
+      return NULL;
+    slabUnlink(&c->empty, s);
+    slabPush(&c->partial, s);
+  }
+
+  if(c->mesh){
+    span_t *sp=(span_t *)s;
+    long i;
+    for(i=0; sp->live[i/64] & (1UL<<(i%64)); i++)
+      ;
+    sp->live[i/64]|=1UL<<(i%64);
+    obj=sp->pages[0]+i*c->stride;
+  }
+  else{
+    obj=s->freeObjs;
+    s->freeObjs=slot_tag(c, obj);
+  }
+  slot_tag(c, obj)=s;
+  s->inUse++;
+  if(s->inUse==c->perSlab){
+    slabUnlink(&c->partial, s);
+    slabPush(&c->full, s);
+  }
+  return obj;
+}
+
+/*
+ * mm_cache_free - give obj back to its slab, obj must be in the
+ * same constructed state the user got it in. 
+ */
+void mm_cache_free(mm_cache_t *c, void *obj){
+  slab_t *s;
+
+  if(obj==NULL)
+    return;
+  s=slot_tag(c, obj);
+  if(s->cache!=c){
+    printf("ERROR: object %p freed to the wrong cache\n", obj);
+    return;
+  }
+
+  if(s->inUse==c->perSlab){
+    slabUnlink(&c->full, s);
+    slabPush(&c->partial, s);
+  }
+  if(c->mesh){
+    long i=((size_t)obj & (mem_pagesize()-1))/c->stride;
+    ((span_t *)s)->live[i/64]&=~(1UL<<(i%64));
+  }
+  else{
+    slot_tag(c, obj)=s->freeObjs;
+    s->freeObjs=obj;
+  }
+  s->inUse--;
+  if(s->inUse==0){
+    slabUnlink(&c->partial, s);
+    slabPush(&c->empty, s);
+  }
+}
+
+/*
+ * mm_cache_destroy - reap c and free it. All of its objects should
+ * have been given back first. 
+ */
+void mm_cache_destroy(mm_cache_t *c){
+  mm_cache_t **cp;
+
+  while(c->empty!=NULL){
+    slab_t *s=c->empty;
+    slabUnlink(&c->empty, s);
+    slabDestroy(c, s);
+  }
+  if(c->partial!=NULL || c->full!=NULL)
+    printf("ERROR: cache destroyed with objects still allocated\n");
+  while(c->partial!=NULL){
+    slab_t *s=c->partial;
+    slabUnlink(&c->partial, s);
+    if(c->mesh)
+      spanDrop(c, s, 0);
+    else
+      cachePut(c->mapped, s);
+  }
+  while(c->full!=NULL){
+    slab_t *s=c->full;
+    slabUnlink(&c->full, s);
+    if(c->mesh)
+      spanDrop(c, s, 0);
+    else
+      cachePut(c->mapped, s);
+  }
+
+  for(cp=&mm->caches; *cp!=NULL; cp=&(*cp)->nextCache){
+    if(*cp==c){
+      *cp=c->nextCache;
+      break;
+    }
+  }
+  cachePut(c->mapped, c);
+}
+
+/***** Mesh mode: *****/
+
+/* A mesh cache keeps its objects in spans of one arena page each (see
+ * memlib), so two pages can be pointed at the same memory. When two
+ * spans have no live slot in common, mm_cache_mesh copies the live
+ * objects of one into the other at the same offsets and aliases its
+ * page onto the other's, so every pointer stays good and the memory
+ * behind the first page goes back to the system. 
+ */
+
+/* Get an arena page and construct all of its objects. The new span
+ * goes on the empty list. Returns NULL if out of memory. 
+ */
+static slab_t *spanCreate(mm_cache_t *c){
+  span_t *sp=cacheGet(c->mapped, sizeof(span_t));
+  void *page;
+  long i;
+
+  if(sp==NULL)
+    return NULL;
+  if((page=mem_arena_page())==(void *)-1){
+    cachePut(c->mapped, sp);
+    return NULL;
+  }
+  sp->slab.cache=c;
+  sp->slab.inUse=0;
+  sp->slab.freeObjs=NULL;
+  memset(sp->live, 0, sizeof(sp->live));
+  sp->pages[0]=page;
+  sp->npages=1;
+  if(c->ctor!=NULL)
+    for(i=0; i<c->perSlab; i++)
+      c->ctor(sp->pages[0]+i*c->stride);
+  slabPush(&c->empty, &sp->slab);
+  return &sp->slab;
+}
+
+/* Give the pages of span s back to the arena, destructing its free
+ * objects first if destruct is set. 
+ */
+static void spanDrop(mm_cache_t *c, slab_t *s, int destruct){
+  span_t *sp=(span_t *)s;
+  long i;
+  int k;
+
+  if(destruct && c->dtor!=NULL)
+    for(i=0; i<c->perSlab; i++)
+      if(!(sp->live[i/64] & (1UL<<(i%64))))
+	c->dtor(sp->pages[0]+i*c->stride);
+  for(k=0; k<sp->npages; k++)
+    mem_arena_free(sp->pages[k]);
+  cachePut(c->mapped, sp);
+}
+
+/* Can b be meshed into a: no live slot in common and few enough pages
+ */
+static int spanMeshable(span_t *a, span_t *b){
+  int w;
+
+  if(a->npages+b->npages>MESH_MAX)
+    return 0;
+  for(w=0; w<MESH_WORDS; w++)
+    if(a->live[w] & b->live[w])
+      return 0;
+  return 1;
+}
+
+/* Move b's live objects into a and alias b's pages onto a's, then
+ * take b off the partial list and forget it. b's free objects and
+ * a's free objects that b's live ones land on are destructed. 
+ */
+static void spanMesh(mm_cache_t *c, span_t *a, span_t *b){
+  long i;
+  int k;
+
+  for(i=0; i<c->perSlab; i++){
+    char *from=b->pages[0]+i*c->stride;
+    char *to=a->pages[0]+i*c->stride;
+
+    if(!(b->live[i/64] & (1UL<<(i%64)))){
+      if(c->dtor!=NULL)
+	c->dtor(from);
+      continue;
+    }
+    if(c->dtor!=NULL)
+      c->dtor(to);
+    memcpy(to, from, c->tagOffset);
+    slot_tag(c, to)=a;
+  }
+  for(k=0; k<b->npages; k++){
+    mem_arena_alias(b->pages[k], a->pages[0]);
+    a->pages[a->npages++]=b->pages[k];
+  }
+  mem_arena_release(b->pages[0]);
+  for(k=0; k<MESH_WORDS; k++)
+    a->live[k]|=b->live[k];
+  a->slab.inUse+=b->slab.inUse;
+  slabUnlink(&c->partial, &b->slab);
+  cachePut(c->mapped, b);
+}
+
+/*
+ * mm_cache_create_mesh - mm_cache_create for a cache whose partly
+ * used slabs mm_cache_mesh can merge. Objects (with a tag word) must
+ * fit at least 2 to a page. NULL if they don't or there is no arena. 
+ */
+mm_cache_t *mm_cache_create_mesh(size_t size, size_t align,
+                                 void (*ctor)(void *), void (*dtor)(void *)){
+  size_t page=mem_pagesize();
+  mm_cache_t *c;
+
+  if(mem_arena_init()<0)
+    return NULL;
+  if((c=mm_cache_create(size, align, ctor, dtor))==NULL)
+    return NULL;
+  c->mesh=1;
+  c->perSlab=page/c->stride;
+  c->slabSize=page;
+  if(c->align>page || c->perSlab<2 || c->perSlab>MESH_SLOTS){
+    mm_cache_destroy(c);
+    return NULL;
+  }
+  return c;
+}
+
+/*
+ * mm_cache_mesh - merge the partly used spans of a mesh cache that
+ * have no live offset in common, returns the bytes given back. 
+ */
+size_t mm_cache_mesh(mm_cache_t *c){
+  slab_t *s=c->partial;
+  size_t saved=0;
+
+  if(!c->mesh)
+    return 0;
+  while(s!=NULL){
+    slab_t *t=s->next;
+    slab_t *next;
+    int probes;
+
+    for(probes=0; t!=NULL && probes<MESH_PROBES; probes++){
+      next=t->next;
+      if(spanMeshable((span_t *)s, (span_t *)t)){
+	spanMesh(c, (span_t *)s, (span_t *)t);
+	saved+=c->slabSize;
+      }
+      t=next;
+    }
+    next=s->next;
+    if(s->inUse==c->perSlab){
+      slabUnlink(&c->partial, s);
+      slabPush(&c->full, s);
+    }
+    s=next;
+  }
+  return saved;
+}
+
+/* Out of memory: give back everything the caches and pool hold, 
+ * returns how many bytes that was. 
+ */
+size_t reclaim(void){
+  return mm_cache_reap()+zpoolDrain();
+}
+
+/*
+ * mm_cache_reap - destroy the empty slabs of every cache, 
+ * returns the number of bytes given back to malloc. 
+ */
+size_t mm_cache_reap(void){
+  mm_cache_t *c;
+  size_t reaped=0;
+
+  for(c=mm->caches; c!=NULL; c=c->nextCache){
+    while(c->empty!=NULL){
+      slab_t *s=c->empty;
+      slabUnlink(&c->empty, s);
+      slabDestroy(c, s);
+      reaped+=c->slabSize;
+    }
+  }
+  return reaped;
+}
+
+/*
+ * Return whether the pointer is in the heap.
+ * May be useful for debugging.
+ */
+static int in_heap(const void *p) {
+    mm_heap_t *h=mm;
+    int kind;
+
+    if(p < h->start+h->root->size && p >= h->start)
+      return 1;
+    return h->regions!=NULL && mem_heap_region_find(h->mem, p, NULL, &kind)!=NULL && 
+      kind==MEM_REGION;
+}
+
+/*
+ * Return whether the pointer is aligned.
+ * May be useful for debugging.
+ */
+static int aligned(const void *p) {
+    return (size_t)ALIGN(p) == (size_t)p;
+}
+
+/* Check the blocks from currentBlock up to an ending block, returns
+ * how many are free. 
+ */
+static int checkBlocks(void *currentBlock){
+  int freeCount=0;
+
+  while(block_size(currentBlock)!=0){
+    if(!is_alloc(currentBlock))
+      freeCount++;
+    if(!in_heap(currentBlock))
+      printf("ERROR: Out of heap\n");
+    if(!aligned(currentBlock))
+      printf("ERROR: Not aligned\n");
+      
+    /* header and footer information is the same */
+    if(gl(currentBlock)!=
+       gl(currentBlock+block_size(currentBlock)+8)){
+      printf("ERROR: Header and Footer don't match up\n");
+      break;
+    }
+      
+    /* if current block is not allocated make sure the next one is
+     * only check inforward direction because every block checks
+     */
+    if(!(is_alloc(currentBlock) || 
+	 is_alloc(currentBlock+block_size(currentBlock)+(2*8))))
+      printf("ERROR: coalescing fail\n");
+    currentBlock+=block_size(currentBlock)+(2*8);
+  }//check all middle blocks
+  return freeCount;
+}
+
+/*
+ * mm_checkheap
+ */
+void mm_checkheap(int verbose) {
+  HEAP_LOCKED;
+  void *currentBlock=mm->start;
+
+  if(verbose>=2){
+    if(gl(currentBlock)!=1)
+      printf("ERROR: Bad dummy starter header: %li => %li, %li\n", 
+	     gl(currentBlock), 
+	     block_size(currentBlock), is_alloc(currentBlock));
+    currentBlock+=8;
+    if(gl(currentBlock)!=1)
+      printf("ERROR: Bad dummy starter footer: %li => %li, %li\n", 
+	     gl(currentBlock), 
+	     block_size(currentBlock), is_alloc(currentBlock));
+  }
+
+  if(verbose>=3){
+    int freeCount=0;
+    void *region;
+
+    freeCount+=checkBlocks(currentBlock+8);
+    for(region=mm->regions; region!=NULL; region=gp(region))
+      freeCount+=checkBlocks(region+8+(2*8));
+
+    currentBlock=getFirst();
     int freeInList=0;
     while(currentBlock!=NULL){
       freeInList++;
@@ -425,7 +2176,7 @@ void mm_checkheap(int verbose) {
 	     freeInList, freeCount);
   }
  
-  currentBlock=start+totalSize-(2*8);
+  currentBlock=mm->start+totalSize-(2*8);
   if(verbose>=2){
     if(gl(currentBlock)!=1)
       printf("ERROR: Bad dummy finisher header: %li, %li\n", 
@@ -434,8 +2185,8 @@ void mm_checkheap(int verbose) {
     if(gl(currentBlock)!=1)
       printf("ERROR: Bad dummy finisher footer: %li, %li\n", 
 	     block_size(currentBlock), is_alloc(currentBlock));
-    if(mem_heap_hi()!=(currentBlock+7))
+    if(mem_heap_high(mm->mem)!=(currentBlock+7))
       printf("ERROR: final block isn't heap high, found: %p, wanted: %p\n", 
-	     (currentBlock+7), mem_heap_hi());
+	     (currentBlock+7), mem_heap_high(mm->mem));
   }
 }
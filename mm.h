@@ -5,21 +5,82 @@
 /* declare functions for driver tests */
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void mm_free_sized(void *ptr, size_t size);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_memalign(size_t align, size_t size);
+extern int mm_posix_memalign(void **memptr, size_t align, size_t size);
+extern void *mm_aligned_alloc(size_t align, size_t size);
+extern size_t mm_malloc_usable_size(void *ptr);
+extern size_t mm_good_size(size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
 
 #else
 
 /* declare functions for interpositioning */
 extern void *malloc (size_t size);
 extern void free (void *ptr);
+extern void free_sized(void *ptr, size_t size);
 extern void *realloc(void *ptr, size_t size);
 extern void *calloc (size_t nmemb, size_t size);
+extern void *memalign(size_t align, size_t size);
+extern int posix_memalign(void **memptr, size_t align, size_t size);
+extern void *aligned_alloc(size_t align, size_t size);
+extern size_t malloc_usable_size(void *ptr);
+extern size_t malloc_good_size(size_t size);
+extern size_t malloc_batch(size_t size, size_t n, void **out);
+extern void free_batch(void **ptrs, size_t n);
 
 #endif
 
 extern int mm_init(void);
 
+/* Allocators on heaps of their own (memlib's mem_heap_create). Every
+   call here works on the one the calling thread last picked with
+   mm_heap_use, at first the one on memlib's default heap. */
+typedef struct mm_heap mm_heap_t;
+struct mem_heap;
+extern mm_heap_t *mm_heap_create(struct mem_heap *heap);
+extern mm_heap_t *mm_heap_use(mm_heap_t *h);
+extern void mm_heap_destroy(mm_heap_t *h);
+
+/* Object caches: objects keep their constructed state while cached */
+typedef struct mm_cache mm_cache_t;
+extern mm_cache_t *mm_cache_create(size_t size, size_t align,
+                                   void (*ctor)(void *), void (*dtor)(void *));
+extern void *mm_cache_alloc(mm_cache_t *cache);
+extern void mm_cache_free(mm_cache_t *cache, void *obj);
+extern void mm_cache_destroy(mm_cache_t *cache);
+extern size_t mm_cache_reap(void);
+
+/* Experimental: caches whose partly used slabs can be merged. Only
+   these slabs are meshed, never blocks from mm_malloc */
+extern mm_cache_t *mm_cache_create_mesh(size_t size, size_t align,
+                                        void (*ctor)(void *),
+                                        void (*dtor)(void *));
+extern size_t mm_cache_mesh(mm_cache_t *cache);
+
+/* Movable blocks behind handles, locked ones stay put */
+typedef size_t mm_handle_t;
+extern mm_handle_t mm_halloc(size_t size);
+extern void *mm_hlock(mm_handle_t h);
+extern void mm_hunlock(mm_handle_t h);
+extern int mm_hrealloc(mm_handle_t h, size_t size);
+extern void mm_hfree(mm_handle_t h);
+extern size_t mm_hcompact(size_t budget);
+
+/* The way into a heap's data when a file heap is reopened */
+extern void mm_set_root(void *ptr);
+extern void *mm_get_root(void);
+
+/* Keep a pool of blocks zeroed ahead of time by free for calloc */
+extern void mm_zpool_enable(int on);
+
+/* memcpy and memset to 0 by size class, as realloc and calloc use */
+extern void mm_copy(void *dst, const void *src, size_t n);
+extern void mm_zero(void *dst, size_t n);
+
 /* This is largely for debugging.  You can do what you want with the
    verbose flag; we don't care. */
 extern void mm_checkheap(int verbose);
@@ -0,0 +1,109 @@
+/*
+ * rep2bin.c - convert a text trace (.rep) into the binary trace format
+ *     of trace.h, which mdriver maps in place instead of parsing. It
+ *     converts one request at a time, so a trace needn't fit in memory.
+ *
+ *     usage: rep2bin <in.rep> <out.bin>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+static const char *partial;  /* output to remove if converting fails */
+
+static void die(const char *filename, const char *msg)
+	__attribute__((noreturn));
+static void die(const char *filename, const char *msg)
+{
+	fprintf(stderr, "rep2bin: %s: %s\n", filename, msg);
+	if (partial != NULL)
+		remove(partial);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	tracehdr_t hdr;
+	traceop_t op;
+	char type[64];
+	long i, index = 0, max_index = -1;
+	int align = 0;
+	size_t size = 0;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <in.rep> <out.bin>\n", argv[0]);
+		exit(1);
+	}
+	if ((in = fopen(argv[1], "r")) == NULL)
+		die(argv[1], "can't open");
+
+	/* the header: weight, ids, ops and ignore-ranges */
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+	hdr.op_size = sizeof(traceop_t);
+	if (fscanf(in, "%d %ld %ld %d", &hdr.weight, &hdr.num_ids, &hdr.num_ops,
+				&hdr.ignore_ranges) != 4)
+		die(argv[1], "bad header");
+	if (hdr.weight < 0 || hdr.weight > 3)
+		die(argv[1], "weight can only be in {0, 1, 2 3}");
+	if (hdr.ignore_ranges != 0 && hdr.ignore_ranges != 1)
+		die(argv[1], "ignore-ranges can only be zero or one");
+	if (hdr.num_ids < 0 || hdr.num_ops < 0)
+		die(argv[1], "negative id or op count");
+	if ((out = fopen(argv[2], "wb")) == NULL)
+		die(argv[2], "can't create");
+	partial = argv[2];
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1)
+		die(argv[2], "write failed");
+
+	/* the requests, checked here so the driver need not. As in the
+	   driver's own reader, a number missing from a request is taken
+	   from the one before. */
+	for (i = 0; i < hdr.num_ops; i++) {
+		memset(&op, 0, sizeof(op));
+		if (fscanf(in, "%63s", type) != 1)
+			die(argv[1], "fewer requests than the header says");
+		switch (type[0]) {
+			case 'a':
+				fscanf(in, "%ld %zu", &index, &size);
+				op.type = ALLOC;
+				break;
+			case 'r':
+				fscanf(in, "%ld %zu", &index, &size);
+				op.type = REALLOC;
+				break;
+			case 'm':
+				fscanf(in, "%ld %zu %d", &index, &size, &align);
+				if (align <= 0 || (align & (align - 1)) != 0)
+					die(argv[1], "memalign alignment is not a power of 2");
+				op.type = MEMALIGN;
+				op.align = align;
+				break;
+			case 'f':
+				fscanf(in, "%ld", &index);
+				op.type = FREE;
+				break;
+			default:
+				die(argv[1], "bogus request type");
+		}
+		op.index = index;
+		if (op.type != FREE)
+			op.size = size;
+		if (index < (op.type == FREE ? -1 : 0) ||
+				index >= hdr.num_ids)	/* free(NULL) is -1 */
+			die(argv[1], "block id out of range");
+		if (op.type != FREE && index > max_index)
+			max_index = index;
+		if (fwrite(&op, sizeof(op), 1, out) != 1)
+			die(argv[2], "write failed");
+	}
+	fclose(in);
+	if (fclose(out) != 0)
+		die(argv[2], "write failed");
+	if (max_index != hdr.num_ids - 1)
+		die(argv[1], "id count doesn't match the requests");
+	return 0;
+}
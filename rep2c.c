@@ -0,0 +1,174 @@
+/*
+ * rep2c.c - compile a text trace (.rep) into straight-line C that makes
+ *     its requests to mm directly, with nothing to interpret at run time.
+ *     Linked with mm.o and the timing code, it times the trace as
+ *     mdriver would, without mdriver's replay loop.
+ *
+ *     usage: rep2c <in.rep> <out.c>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK 1000  /* requests per generated function */
+
+static void die(const char *filename, const char *msg)
+	__attribute__((noreturn));
+static void die(const char *filename, const char *msg)
+{
+	fprintf(stderr, "rep2c: %s: %s\n", filename, msg);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	FILE *in, *out;
+	char type[64], *set;
+	int weight, num_ids, num_ops, ignore_ranges;
+	int i, index = 0, align = 0;
+	size_t size = 0;
+
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <in.rep> <out.c>\n", argv[0]);
+		exit(1);
+	}
+	if ((in = fopen(argv[1], "r")) == NULL)
+		die(argv[1], "can't open");
+	if (fscanf(in, "%d %d %d %d", &weight, &num_ids, &num_ops,
+				&ignore_ranges) != 4 || num_ids < 0 || num_ops < 0)
+		die(argv[1], "bad header");
+	/* which ids have a block yet; mdriver's are NULL until then */
+	if ((set = calloc(num_ids, 1)) == NULL)
+		die(argv[1], "out of memory");
+	if ((out = fopen(argv[2], "w")) == NULL)
+		die(argv[2], "can't create");
+
+	fprintf(out,
+		"/* %s, compiled by rep2c. Do not edit. */\n"
+		"#include <stdio.h>\n"
+		"#include <stdlib.h>\n"
+		"#include \"mm.h\"\n"
+		"#include \"memlib.h\"\n"
+		"#include \"fsecs.h\"\n"
+		"\n"
+		"#define NUM_OPS %d\n"
+		"\n"
+		"int verbose;  /* for fsecs */\n"
+		"\n"
+		"static void fail(void) __attribute__((noreturn, cold));\n"
+		"static void fail(void)\n"
+		"{\n"
+		"\tfprintf(stderr, \"an allocation failed\\n\");\n"
+		"\texit(1);\n"
+		"}\n"
+		"\n"
+		"/* The requests, made inline on run's table p of blocks by id.\n"
+		"   A failure is only noted, and checked once per function, so a\n"
+		"   request costs its call and a few instructions around it */\n"
+		"#define A(i, n) bad |= (p[i] = mm_malloc(n)) == NULL\n"
+		"#define M(i, a, n) bad |= (p[i] = mm_memalign(a, n)) == NULL\n"
+		"#define R(i, n) bad |= (p[i] = mm_realloc(p[i], n)) == NULL\n"
+		"#define R0(i, n) bad |= (p[i] = mm_realloc(NULL, n)) == NULL\n"
+		"#define Z(i) p[i] = mm_realloc(p[i], 0)\n"
+		"#define Z0(i) p[i] = mm_realloc(NULL, 0)\n"
+		"#define F(i) mm_free(p[i])\n"
+		"#define F0() mm_free(NULL)\n",
+		argv[1], num_ops);
+
+	/* the requests, CHUNK to a function so the compiler copes */
+	for (i = 0; i < num_ops; i++) {
+		if (i % CHUNK == 0)
+			fprintf(out, "%s\nstatic int replay%d(char **p)\n{\n"
+					"\tint bad = 0;\n\n",
+					i > 0 ? "\treturn bad;\n}\n" : "", i / CHUNK);
+		if (fscanf(in, "%63s", type) != 1)
+			die(argv[1], "fewer requests than the header says");
+		/* as in mdriver, a number missing from a request is taken
+		   from the one before */
+		switch (type[0]) {
+			case 'a':
+			case 'r':
+				fscanf(in, "%d %zu", &index, &size);
+				break;
+			case 'm':
+				fscanf(in, "%d %zu %d", &index, &size, &align);
+				if (align <= 0 || (align & (align - 1)) != 0)
+					die(argv[1], "memalign alignment is not a power of 2");
+				break;
+			case 'f':
+				fscanf(in, "%d", &index);
+				break;
+			default:
+				die(argv[1], "bogus request type");
+		}
+		if (index < (type[0] == 'f' ? -1 : 0) || index >= num_ids)
+			die(argv[1], "block id out of range");
+
+		switch (type[0]) {
+			case 'a':
+				fprintf(out, "\tA(%d, %zu);\n", index, size);
+				break;
+			case 'm':
+				fprintf(out, "\tM(%d, %d, %zu);\n", index, align, size);
+				break;
+			case 'r':
+				if (size == 0)	/* frees, so NULL is no failure */
+					fprintf(out, "\t%s(%d);\n", set[index] ? "Z" : "Z0",
+							index);
+				else
+					fprintf(out, "\t%s(%d, %zu);\n", set[index] ? "R" : "R0",
+							index, size);
+				break;
+			case 'f':
+				if (index >= 0 && set[index])
+					fprintf(out, "\tF(%d);\n", index);
+				else
+					fprintf(out, "\tF0();\n");
+				break;
+		}
+		if (type[0] != 'f')
+			set[index] = 1;
+	}
+	fclose(in);
+	if (num_ops > 0)
+		fprintf(out, "\treturn bad;\n}\n");
+
+	/* the table of those functions, and the timing */
+	fprintf(out, "\nstatic int (*const replay[])(char **p) = {\n");
+	for (i = 0; i < num_ops; i += CHUNK)
+		fprintf(out, "\treplay%d,\n", i / CHUNK);
+	fprintf(out, "\tNULL\n};\n");
+	fprintf(out,
+		"\n"
+		"static void run(void *arg)\n"
+		"{\n"
+		"\tchar *p[%d] = { NULL };  /* the blocks, by id */\n"
+		"\tint (*const *f)(char **p);\n"
+		"\n"
+		"\t(void)arg;\n"
+		"\tmem_reset_brk();\n"
+		"\tif (mm_init() < 0)\n"
+		"\t\tfail();\n"
+		"\tfor (f = replay; *f != NULL; f++)\n"
+		"\t\tif ((*f)(p))\n"
+		"\t\t\tfail();\n"
+		"}\n"
+		"\n"
+		"int main(void)\n"
+		"{\n"
+		"\tdouble secs;\n"
+		"\n"
+		"\tmem_init();\n"
+		"\tinit_fsecs();\n"
+		"\tsecs = fsecs(run, NULL);\n"
+		"\tprintf(\"%%s: %%d ops in %%.6f secs, %%.0f Kops\\n\", \"%s\",\n"
+		"\t\t\tNUM_OPS, secs, NUM_OPS / 1e3 / secs);\n"
+		"\tmem_deinit();\n"
+		"\treturn 0;\n"
+		"}\n",
+		num_ids > 0 ? num_ids : 1, argv[1]);
+	free(set);
+	if (fclose(out) != 0)
+		die(argv[2], "write failed");
+	return 0;
+}
@@ -0,0 +1,36 @@
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+/*
+ * trace.h - trace requests as the driver keeps them, and the binary
+ *     trace format that holds them as is
+ *
+ * A binary trace (made from a .rep by rep2bin) is a tracehdr_t followed
+ * by num_ops traceop_t records in the machine's own layout, so the
+ * driver can map the file and use the records in place.
+ */
+
+#include <stddef.h>
+
+/* Characterizes a single trace operation (allocator request). Ids are
+   64-bit so a streamed trace (mdriver -S) need never reuse one. */
+typedef struct {
+	enum { ALLOC, FREE, REALLOC, MEMALIGN } type; /* type of request */
+	int align;                        /* alignment of a memalign request */
+	long index;                       /* index for free() to use later */
+	size_t size;                      /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Starts a binary trace, the fields are those of a .rep header */
+#define TRACE_MAGIC "MMTRACE2"
+typedef struct {
+	char magic[8];       /* TRACE_MAGIC, without the NUL */
+	int op_size;         /* sizeof(traceop_t) where it was written */
+	int weight;
+	int ignore_ranges;
+	int unused;          /* keeps the counts 8 byte aligned */
+	long num_ids;
+	long num_ops;
+} tracehdr_t;
+
+#endif /* __TRACE_H_ */